@@ -104,6 +104,42 @@ int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
 int HAL_SendIPPacket(int if_index, uint8_t *buffer, size_t length,
                      macaddr_t dst_mac);
 
+/**
+ * @brief ARP 表变化时的回调
+ *
+ * @param if_index IN，接口索引号
+ * @param ip IN，变化的表项的 IP 地址
+ * @param mac IN，学到的 MAC 地址，NULL 表示该表项被删除
+ */
+typedef void (*HAL_ArpHandler)(int if_index, in_addr_t ip, const uint8_t *mac);
+
+/**
+ * @brief 设置 ARP 表变化时的回调，在 HAL_ReceiveIPPacket
+ * 中学到新的（或改变了的）MAC 地址、或表项被替换出去或过期时调用。
+ * Linux 和 macOS 后端的表项一分钟内没有被 ARP 报文刷新就过期，过期前会重新询问
+ *
+ * @param handler IN，回调函数，NULL 表示不需要通知
+ */
+void HAL_SetArpHandler(HAL_ArpHandler handler);
+
+/**
+ * @brief 端口链路状态变化时的回调
+ *
+ * @param if_index IN，接口索引号
+ * @param up IN，非零表示链路恢复，零表示链路断开
+ */
+typedef void (*HAL_LinkHandler)(int if_index, int up);
+
+/**
+ * @brief 设置链路状态变化时的回调，在 HAL_ReceiveIPPacket
+ * 中检测到端口的链路状态（linux 和 macOS 为网卡的 IFF_UP 和 IFF_RUNNING
+ * 标志）变化时调用，每个端口至多每 100 毫秒检测一次；stdio 和 xilinx
+ * 后端无法得知链路状态，从不调用
+ *
+ * @param handler IN，回调函数，NULL 表示不需要通知
+ */
+void HAL_SetLinkHandler(HAL_LinkHandler handler);
+
 #ifdef __cplusplus
 }
 #endif
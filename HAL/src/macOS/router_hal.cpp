@@ -42,6 +42,118 @@ struct macaddr_wrap {
 
 std::map<std::pair<in_addr_t, int>, macaddr_wrap> arp_table;
 std::map<std::pair<in_addr_t, int>, uint64_t> arp_timer;
+HAL_ArpHandler arp_handler = NULL;
+HAL_LinkHandler link_handler = NULL;
+int link_socket = -1;
+int link_up[N_IFACE_ON_BOARD] = {0};
+uint64_t link_checked = 0;
+// 从 ARP 报文学到的表项最后一次刷新的时刻，网卡自己的地址不在这里，不会过期
+std::map<std::pair<in_addr_t, int>, uint64_t> arp_learned;
+uint64_t arp_checked = 0;
+const uint64_t ARP_PROBE = 45 * 1000;
+const uint64_t ARP_TIMEOUT = 60 * 1000;
+
+// 网卡的链路状态，查询失败（如网卡不存在）时当作断开
+static int HAL_LinkUp(int if_index) {
+  struct ifreq ifr;
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, interfaces[if_index], IFNAMSIZ - 1);
+  if (link_socket < 0 || ioctl(link_socket, SIOCGIFFLAGS, &ifr) < 0) {
+    return 0;
+  }
+  return (ifr.ifr_flags & IFF_UP) && (ifr.ifr_flags & IFF_RUNNING);
+}
+
+// 在 HAL_ReceiveIPPacket 中调用，状态变化时通知 link_handler
+static void HAL_PollLinks() {
+  if (!link_handler || HAL_GetTicks() < link_checked + 100) {
+    return;
+  }
+  link_checked = HAL_GetTicks();
+  for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+    int up = HAL_LinkUp(i);
+    if (up != link_up[i]) {
+      link_up[i] = up;
+      if (debugEnabled) {
+        fprintf(stderr, "HAL_PollLinks: link of %s is %s\n", interfaces[i],
+                up ? "up" : "down");
+      }
+      link_handler(i, up);
+    }
+  }
+}
+
+// 广播一个询问 ip 的 ARP 请求
+static void HAL_SendArpRequest(int if_index, in_addr_t ip) {
+  if (debugEnabled) {
+    struct in_addr addr;
+    addr.s_addr = ip;
+    fprintf(
+        stderr,
+        "HAL_SendArpRequest: asking for ip address %s with arp request\n",
+        inet_ntoa(addr));
+  }
+  uint8_t buffer[64] = {0};
+  // dst mac
+  for (int i = 0; i < 6; i++) {
+    buffer[i] = 0xff;
+  }
+  // src mac
+  macaddr_t mac;
+  HAL_GetInterfaceMacAddress(if_index, mac);
+  memcpy(&buffer[6], mac, sizeof(macaddr_t));
+  // ARP
+  buffer[12] = 0x08;
+  buffer[13] = 0x06;
+  // hardware type
+  buffer[15] = 0x01;
+  // protocol type
+  buffer[16] = 0x08;
+  // hardware size
+  buffer[18] = 0x06;
+  // protocol size
+  buffer[19] = 0x04;
+  // opcode
+  buffer[21] = 0x01;
+  // sender
+  memcpy(&buffer[22], mac, sizeof(macaddr_t));
+  memcpy(&buffer[28], &interface_addrs[if_index], sizeof(in_addr_t));
+  // target
+  memcpy(&buffer[38], &ip, sizeof(in_addr_t));
+
+  pcap_inject(pcap_out_handles[if_index], buffer, sizeof(buffer));
+}
+
+// 表项学到后 ARP_PROBE 起每秒重新询问一次，ARP_TIMEOUT 内没有应答就删除，并通知 arp_handler
+static void HAL_AgeArp() {
+  if (HAL_GetTicks() < arp_checked + 1000) {
+    return;
+  }
+  uint64_t now = arp_checked = HAL_GetTicks();
+  for (auto it = arp_learned.begin(); it != arp_learned.end();) {
+    auto key = it->first;
+    if (now >= it->second + ARP_TIMEOUT) {
+      it = arp_learned.erase(it);
+      arp_table.erase(key);
+      if (debugEnabled) {
+        struct in_addr addr;
+        addr.s_addr = key.first;
+        fprintf(stderr, "HAL_AgeArp: MAC address of %s expired\n",
+                inet_ntoa(addr));
+      }
+      if (arp_handler) {
+        arp_handler(key.second, key.first, NULL);
+      }
+      continue;
+    }
+    if (now >= it->second + ARP_PROBE && pcap_out_handles[key.second] &&
+        arp_timer[key] + 1000 < now) {
+      arp_timer[key] = now;
+      HAL_SendArpRequest(key.second, key.first);
+    }
+    ++it;
+  }
+}
 
 extern "C" {
 int HAL_Init(int debug, in_addr_t if_addrs[N_IFACE_ON_BOARD]) {
@@ -148,6 +260,11 @@ int HAL_Init(int debug, in_addr_t if_addrs[N_IFACE_ON_BOARD]) {
   memcpy(interface_addrs, if_addrs, sizeof(interface_addrs));
 
   inited = true;
+  // 只用来查询网卡标志
+  link_socket = socket(AF_INET, SOCK_DGRAM, 0);
+  for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+    link_up[i] = HAL_LinkUp(i);
+  }
   for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
     if (pcap_out_handles[i]) {
       HAL_JoinIGMPGroup(i, if_addrs[i]);
@@ -188,47 +305,15 @@ int HAL_ArpGetMacAddress(int if_index, in_addr_t ip, macaddr_t o_mac) {
              arp_timer[std::pair<in_addr_t, int>(ip, if_index)] + 1000 <
                  HAL_GetTicks()) {
     arp_timer[std::pair<in_addr_t, int>(ip, if_index)] = HAL_GetTicks();
-    if (debugEnabled) {
-      struct in_addr addr;
-      addr.s_addr = ip;
-      fprintf(
-          stderr,
-          "HAL_ArpGetMacAddress: asking for ip address %s with arp request\n",
-          inet_ntoa(addr));
-    }
-    uint8_t buffer[64] = {0};
-    // dst mac
-    for (int i = 0; i < 6; i++) {
-      buffer[i] = 0xff;
-    }
-    // src mac
-    macaddr_t mac;
-    HAL_GetInterfaceMacAddress(if_index, mac);
-    memcpy(&buffer[6], mac, sizeof(macaddr_t));
-    // ARP
-    buffer[12] = 0x08;
-    buffer[13] = 0x06;
-    // hardware type
-    buffer[15] = 0x01;
-    // protocol type
-    buffer[16] = 0x08;
-    // hardware size
-    buffer[18] = 0x06;
-    // protocol size
-    buffer[19] = 0x04;
-    // opcode
-    buffer[21] = 0x01;
-    // sender
-    memcpy(&buffer[22], mac, sizeof(macaddr_t));
-    memcpy(&buffer[28], &interface_addrs[if_index], sizeof(in_addr_t));
-    // target
-    memcpy(&buffer[38], &ip, sizeof(in_addr_t));
-
-    pcap_inject(pcap_out_handles[if_index], buffer, sizeof(buffer));
+    HAL_SendArpRequest(if_index, ip);
   }
   return HAL_ERR_IP_NOT_EXIST;
 }
 
+void HAL_SetArpHandler(HAL_ArpHandler handler) { arp_handler = handler; }
+
+void HAL_SetLinkHandler(HAL_LinkHandler handler) { link_handler = handler; }
+
 int HAL_GetInterfaceMacAddress(int if_index, macaddr_t o_mac) {
   if (!inited) {
     return HAL_ERR_CALLED_BEFORE_INIT;
@@ -272,6 +357,8 @@ int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
   int current_port = 0;
   struct pcap_pkthdr hdr;
   do {
+    HAL_PollLinks();
+    HAL_AgeArp();
     if ((if_index_mask & (1 << current_port)) == 0 ||
         !pcap_in_handles[current_port]) {
       current_port = (current_port + 1) % N_IFACE_ON_BOARD;
@@ -304,6 +391,10 @@ int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
       memcpy(&ip, &packet[28], sizeof(in_addr_t));
       memcpy(&arp_table[std::pair<in_addr_t, int>(ip, current_port)], mac,
              sizeof(macaddr_t));
+      arp_learned[std::pair<in_addr_t, int>(ip, current_port)] = HAL_GetTicks();
+      if (arp_handler) {
+        arp_handler(current_port, ip, mac);
+      }
       if (debugEnabled) {
         struct in_addr addr;
         addr.s_addr = ip;
@@ -29,6 +29,7 @@ struct macaddr_wrap {
 };
 
 std::map<std::pair<in_addr_t, int>, macaddr_wrap> arp_table;
+HAL_ArpHandler arp_handler = NULL;
 
 extern "C" {
 int HAL_Init(int debug, in_addr_t if_addrs[N_IFACE_ON_BOARD]) {
@@ -147,6 +148,11 @@ int HAL_ArpGetMacAddress(int if_index, in_addr_t ip, macaddr_t o_mac) {
   return HAL_ERR_IP_NOT_EXIST;
 }
 
+void HAL_SetArpHandler(HAL_ArpHandler handler) { arp_handler = handler; }
+
+// 无法得知链路状态，回调从不调用
+void HAL_SetLinkHandler(HAL_LinkHandler handler) { (void)handler; }
+
 int HAL_GetInterfaceMacAddress(int if_index, macaddr_t o_mac) {
   if (!inited) {
     return HAL_ERR_CALLED_BEFORE_INIT;
@@ -208,6 +214,9 @@ int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
 
         memcpy(&arp_table[std::pair<in_addr_t, int>(ip, current_port)], mac,
                sizeof(macaddr_t));
+        if (arp_handler) {
+          arp_handler(current_port, ip, mac);
+        }
         if (debugEnabled) {
           struct in_addr addr;
           addr.s_addr = ip;
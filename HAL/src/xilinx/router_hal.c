@@ -56,6 +56,7 @@ struct ArpTableEntry {
   macaddr_t mac;
   in_addr_t ip;
 } arpTable[ARP_TABLE_SIZE];
+HAL_ArpHandler arp_handler = NULL;
 
 void SpiWriteRegister(u8 addr, u8 data) {
   u8 writeBuffer[3];
@@ -267,6 +268,11 @@ int HAL_ArpGetMacAddress(int if_index, in_addr_t ip, macaddr_t o_mac) {
   return HAL_ERR_IP_NOT_EXIST;
 }
 
+void HAL_SetArpHandler(HAL_ArpHandler handler) { arp_handler = handler; }
+
+// 无法得知链路状态，回调从不调用
+void HAL_SetLinkHandler(HAL_LinkHandler handler) { (void)handler; }
+
 int HAL_GetInterfaceMacAddress(int if_index, macaddr_t o_mac) {
   if (!inited) {
     return HAL_ERR_CALLED_BEFORE_INIT;
@@ -326,6 +332,10 @@ int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
         for (int i = 0; i < ARP_TABLE_SIZE; i++) {
           if (arpTable[i].if_index == vlan &&
               memcmp(arpTable[i].mac, mac, sizeof(macaddr_t)) == 0) {
+            if (arp_handler && arpTable[i].ip != ip) {
+              arp_handler(vlan, arpTable[i].ip, NULL);
+              arp_handler(vlan, ip, mac);
+            }
             arpTable[i].ip = ip;
             insert = 0;
             break;
@@ -333,11 +343,19 @@ int HAL_ReceiveIPPacket(int if_index_mask, uint8_t *buffer, size_t length,
         }
 
         if (insert) {
+          // the last entry is evicted
+          struct ArpTableEntry *last = &arpTable[ARP_TABLE_SIZE - 1];
+          if (arp_handler && last->ip) {
+            arp_handler(last->if_index, last->ip, NULL);
+          }
           memmove(&arpTable[1], arpTable,
                   (ARP_TABLE_SIZE - 1) * sizeof(struct ArpTableEntry));
           arpTable[0].if_index = vlan;
           memcpy(arpTable[0].mac, mac, sizeof(macaddr_t));
           arpTable[0].ip = ip;
+          if (arp_handler) {
+            arp_handler(vlan, ip, mac);
+          }
           if (debugEnabled) {
             xil_printf("HAL_ReceiveIPPacket: learned ARP from %d.%d.%d.%d\r\n",
                        ip & 0xFF, (ip >> 8) & 0xFF, (ip >> 16) & 0xFF,
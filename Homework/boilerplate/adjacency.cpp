@@ -0,0 +1,88 @@
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <unordered_map>
+
+#include "router_hal.h"
+
+extern void cache_flush();
+
+/*
+  邻接表：每个 (nexthop, if_index) 一条记录，保存出接口和解析好的 MAC 地址。
+  转发缓存中只记录邻接的编号，多个目的地址共用同一条记录，
+  HAL 学到或删除 ARP 表项时原地更新记录，不需要清空转发缓存。
+  编号从 1 开始，0 表示没有邻接。
+  邻接编号不存进转发表：各个引擎的查表结果只有 nexthop 和 if_index ，
+  它们和 lookup 作业共用 FibEngine 接口，所以未命中缓存时要查一次表再查一次 ids 。
+  直连路由的每个目的主机都有一条记录，记录数达到 MAX_ADJS 时清空整个表，
+  引用编号的只有转发缓存，一起清空即可；清掉的 MAC 地址之后从 HAL 的 ARP 表重新取得。
+*/
+struct AdjacencyTable {
+    static constexpr uint32_t MAX_ADJS = 1 << 16;
+
+    struct adj_t {
+        uint32_t nexthop;
+        uint32_t if_index;
+        macaddr_t mac;
+        bool resolved;
+    };
+    std::vector<adj_t> adjs;                    // 下标 0 不使用
+    std::unordered_map<uint64_t, uint32_t> ids;    // (nexthop, if_index) -> 编号
+
+    AdjacencyTable() : adjs(1) {}
+
+    static uint64_t key(uint32_t nexthop, uint32_t if_index) {
+        return uint64_t(nexthop) << 32 | if_index;
+    }
+
+    uint32_t get(uint32_t nexthop, uint32_t if_index) {
+        if (adjs.size() > MAX_ADJS && !ids.count(key(nexthop, if_index))) {
+            adjs.resize(1);
+            ids.clear();
+            cache_flush();
+        }
+        auto &id = ids[key(nexthop, if_index)];
+        if (!id) {
+            id = adjs.size();
+            adjs.push_back(adj_t{nexthop, if_index, {}, false});
+        }
+        return id;
+    }
+
+    bool resolve(uint32_t id, uint32_t *nexthop, uint32_t *if_index, macaddr_t mac) {
+        auto &adj = adjs[id];
+        *nexthop = adj.nexthop;
+        *if_index = adj.if_index;
+        // 还没有解析时由 HAL 查 ARP 表，查不到会发出 ARP 请求
+        if (!adj.resolved && HAL_ArpGetMacAddress(adj.if_index, adj.nexthop, adj.mac) == 0) adj.resolved = true;
+        if (!adj.resolved) return false;
+        memcpy(mac, adj.mac, sizeof(macaddr_t));
+        return true;
+    }
+
+    // 只更新已有的记录，不为路由用不到的主机建立记录
+    void learn(int if_index, uint32_t ip, const uint8_t *mac) {
+        auto it = ids.find(key(ip, if_index));
+        if (it == ids.end()) return;
+        auto &adj = adjs[it->second];
+        if (mac) memcpy(adj.mac, mac, sizeof(macaddr_t));
+        adj.resolved = mac != nullptr;
+    }
+};
+static AdjacencyTable adjacency;
+
+uint32_t adj_get(uint32_t nexthop, uint32_t if_index) {
+    return adjacency.get(nexthop, if_index);
+}
+
+bool adj_resolve(uint32_t adj, uint32_t *nexthop, uint32_t *if_index, macaddr_t mac) {
+    return adjacency.resolve(adj, nexthop, if_index, mac);
+}
+
+void adj_learn(int if_index, in_addr_t ip, const uint8_t *mac) {
+    adjacency.learn(if_index, ip, mac);
+}
+
+size_t adj_count() {
+    return adjacency.adjs.size() - 1;
+}
@@ -0,0 +1,85 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "router_hal.h"
+
+extern uint32_t get_generation();
+
+// 转发路径上的目的地址缓存：/32 -> 邻接编号（见 adjacency.cpp）
+// 2 路组相联，路由表的 generation 变化后整体失效，ARP 的变化在邻接表中更新
+struct DestCache {
+    static constexpr int SET_BITS = 11;
+    static constexpr int WAYS = 2;
+
+    struct line_t {
+        uint32_t addr;
+        uint32_t generation;
+        uint32_t adj;
+        bool valid;
+    };
+    struct set_t {
+        line_t way[WAYS];
+        uint8_t victim;     // 下一次替换的路
+    };
+    set_t sets[1 << SET_BITS];
+    uint64_t hit = 0, miss = 0, stale = 0;
+
+    static uint32_t hash(uint32_t addr) {
+        return (addr * 0x9e3779b1u) >> (32 - SET_BITS);
+    }
+
+    bool lookup(uint32_t addr, uint32_t *adj) {
+        auto &set = sets[hash(addr)];
+        for (int i = 0; i < WAYS; i++) {
+            auto &line = set.way[i];
+            if (!line.valid || line.addr != addr) continue;
+            if (line.generation != get_generation()) {
+                line.valid = false;
+                stale++;
+                break;
+            }
+            *adj = line.adj;
+            set.victim = (i + 1) % WAYS;
+            hit++;
+            return true;
+        }
+        miss++;
+        return false;
+    }
+
+    void fill(uint32_t addr, uint32_t adj) {
+        auto &set = sets[hash(addr)];
+        int i = set.victim;
+        for (int j = 0; j < WAYS; j++) {
+            if (!set.way[j].valid) {
+                i = j;
+                break;
+            }
+        }
+        auto &line = set.way[i];
+        line.addr = addr;
+        line.generation = get_generation();
+        line.adj = adj;
+        line.valid = true;
+        set.victim = (i + 1) % WAYS;
+    }
+};
+static DestCache cache;
+
+bool cache_lookup(uint32_t addr, uint32_t *adj) {
+    return cache.lookup(addr, adj);
+}
+
+void cache_fill(uint32_t addr, uint32_t adj) {
+    cache.fill(addr, adj);
+}
+
+void cache_flush() {
+    memset(cache.sets, 0, sizeof(cache.sets));
+}
+
+void cache_stats(uint64_t *hit, uint64_t *miss, uint64_t *stale) {
+    *hit = cache.hit;
+    *miss = cache.miss;
+    *stale = cache.stale;
+}
@@ -0,0 +1,82 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+#include <algorithm>
+#include <unordered_map>
+
+/*
+  路由振荡抑制（参考 RFC 2439）：每个前缀一个惩罚值，每次振荡加上一定的惩罚，
+  惩罚值按半衰期指数衰减，超过 SUPPRESS 时抑制这个前缀，衰减到 REUSE 以下时解除。
+  衰减在访问时按经过的时间一次算出，不需要定时器。
+  惩罚值衰减到 FORGET 以下且没有被抑制的记录在访问时删除。
+  记录不放在路由表项中：撤销的路由垃圾回收后表项就没了，而惩罚要留到它再次出现时，
+  RoutingTableEntry 也是 lookup 作业的接口，不便加字段。每条记录只有 8 字节，
+  只有振荡过的前缀才有记录。
+*/
+struct FlapDampening {
+    static constexpr double HALF_LIFE = 60;     // 秒
+    static constexpr uint32_t SUPPRESS = 2000;
+    static constexpr uint32_t REUSE = 750;
+    static constexpr uint32_t FORGET = 100;
+    static constexpr uint32_t MAX_PENALTY = 6000;   // 最长抑制 HALF_LIFE * log2(MAX_PENALTY / REUSE)
+
+    struct damp_t {
+        uint16_t penalty;
+        bool suppressed;
+        uint32_t stamp;         // 上一次更新 penalty 的时刻，秒
+    };
+    std::unordered_map<uint64_t, damp_t> prefixes;
+    size_t suppressed = 0;
+
+    static uint32_t decay(const damp_t &d, uint32_t now) {
+        return uint32_t(d.penalty * exp2(-(now - d.stamp) / HALF_LIFE));
+    }
+
+    // 衰减到 now ，返回记录是否还需要保留
+    bool age(damp_t &d, uint32_t now) {
+        d.penalty = decay(d, now);
+        d.stamp = now;
+        if (d.suppressed && d.penalty < REUSE) {
+            d.suppressed = false;
+            suppressed--;
+        }
+        return d.suppressed || d.penalty >= FORGET;
+    }
+
+    bool flap(uint64_t key, uint32_t now, uint32_t penalty) {
+        auto &d = prefixes[key];
+        if (d.stamp) age(d, now);
+        d.stamp = now;
+        d.penalty = std::min<uint32_t>(d.penalty + penalty, MAX_PENALTY);
+        if (!d.suppressed && d.penalty >= SUPPRESS) {
+            d.suppressed = true;
+            suppressed++;
+        }
+        return d.suppressed;
+    }
+
+    bool is_suppressed(uint64_t key, uint32_t now) {
+        auto it = prefixes.find(key);
+        if (it == prefixes.end()) return false;
+        if (!age(it->second, now)) {
+            prefixes.erase(it);
+            return false;
+        }
+        return it->second.suppressed;
+    }
+};
+static FlapDampening dampening;
+
+bool damp_flap(uint64_t key, uint64_t now, uint32_t penalty) {
+    // stamp 为 0 表示新记录，时刻从 1 开始
+    return dampening.flap(key, now / 1000 + 1, penalty);
+}
+
+bool damp_suppressed(uint64_t key, uint64_t now) {
+    return dampening.is_suppressed(key, now / 1000 + 1);
+}
+
+void damp_stats(size_t *tracked, size_t *suppressed) {
+    *tracked = dampening.prefixes.size();
+    *suppressed = dampening.suppressed;
+}
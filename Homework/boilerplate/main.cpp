@@ -4,6 +4,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <algorithm>
+#include <deque>
+#include <unordered_set>
 
 #include "rip.h"
 #include "router.h"
@@ -33,6 +35,76 @@ extern void update(bool insert, RoutingTableEntry entry);
  */
 extern bool query(uint32_t addr, uint32_t *nexthop, uint32_t *if_index);
 extern bool query(uint32_t addr, uint32_t mask, RoutingTableEntry& entry);
+/**
+ * @brief 转发用的查询，路由有多条等价路径时按流哈希选一条
+ * @param hash flow_hash 算出的流哈希，同一条流总是选到同一条路径
+ * @param multipath 如果选自多条等价路径则置为 true ，这时结果不能按目的地址缓存
+ */
+extern bool query_flow(uint32_t addr, uint32_t hash, uint32_t *nexthop, uint32_t *if_index, bool *multipath);
+/**
+ * @brief 给已有的路由加一条等价路径（ECMP）
+ * @param entry addr、len 和 metric 与已有表项相同，nexthop 和 if_index 为新路径
+ * @return 新加入时返回 true ；没有这条路由、metric 不同、已是成员或路径数已满时返回 false
+ */
+extern bool add_path(const RoutingTableEntry &entry);
+/**
+ * @brief 从路由的等价路径中去掉一条，去掉主路径时由剩下的一条顶替
+ * @return 路由有多条路径且 entry 的 nexthop、if_index 是其中之一时返回 true
+ */
+extern bool remove_path(const RoutingTableEntry &entry);
+// 按五元组计算流哈希，packet 为完整的 IP 报文
+extern uint32_t flow_hash(const uint8_t *packet, size_t len);
+/**
+ * @brief 插入一条路由表项，若已有 addr 和 len 都相同的表项则原地替换
+ * @param entry 要插入的表项
+ * @return 新插入或者 nexthop、if_index、metric 有变化时返回 true ，否则返回 false
+ *
+ * 按 (addr, len) 在哈希索引中精确查找，已有表项时不需要遍历 trie 。
+ */
+extern bool upsert(const RoutingTableEntry &entry);
+/**
+ * @brief 用一组表项重建整个路由表，原有表项全部丢弃
+ * @param entries 表项数组，不需要有序，addr 和 len 都相同时以后出现的为准
+ * @param n 表项个数
+ *
+ * 排序后一次性建出整棵 trie ，比逐条 update 快得多，适合启动时载入大量路由。
+ */
+extern void build(const RoutingTableEntry *entries, size_t n);
+// 路由表每次修改后都会变化的版本号
+extern uint32_t get_generation();
+/**
+ * @brief 开始一批修改，之后的 update、upsert、add_path、remove_path 都不改变版本号
+ *
+ * 一个 RIP 响应（或者排队的几个）中的全部修改作为一批，转发路径只看到一次变化。
+ */
+extern void batch_begin();
+/**
+ * @brief 提交这一批修改，有修改时版本号只变化一次
+ * @param changed 把表项有变化的路由追加到末尾，每个前缀一次，为提交时的状态，已删除的 metric 为 16
+ * @return 有变化的前缀数
+ */
+extern size_t batch_commit(std::vector<RoutingTableEntry> &changed);
+/**
+ * @brief 按名字选择转发表引擎（trie、dir24、bsl，默认 trie），已有的路由全部放进新引擎
+ *        名字前加 ortc- 表示先做 ORTC 压缩再放进这个引擎
+ * @return 没有这个名字的引擎时返回 false ，原来的引擎不变
+ */
+extern bool select_engine(const char *name);
+// 当前转发表引擎的名字
+extern const char *get_engine_name();
+/**
+ * @brief 把路由表写成 FIB 快照文件，先写临时文件再改名
+ * @return 成功返回 true
+ */
+extern bool save_snapshot(const char *path);
+/**
+ * @brief mmap 一个 FIB 快照文件代替当前路由表
+ * @return 文件不存在或格式、版本不对时返回 false ，路由表不变
+ *
+ * 转发查询和读路由表（取表项、分块、精确查找）都直接在映射的文件上进行，不需要反序列化；
+ * 第一次修改路由表时才把快照转成可修改的路由表。
+ */
+extern bool load_snapshot(const char *path);
 /**
  * @brief 进行转发时所需的 IP 头的更新：
  *        你需要先检查 IP 头校验和的正确性，如果不正确，直接返回 false ；
@@ -58,6 +130,11 @@ extern bool forward(uint8_t *packet, size_t len);
  * Mask 的二进制是不是连续的 1 与连续的 0 组成等等。
  */
 extern bool disassemble(const uint8_t *packet, uint32_t len, RipPacket *output);
+/**
+ * @brief 和 disassemble 做同样的检查，但不复制表项，view 直接指向 packet 中的表项
+ * @return 合法时返回 true ，之后通过 view 按下标读取表项
+ */
+extern bool parse_rip(const uint8_t *packet, uint32_t len, RipView *view);
 /**
  * @brief 从 RipPacket 的数据结构构造出 RIP 协议的二进制格式
  * @param rip 一个 RipPacket 结构体
@@ -70,10 +147,98 @@ extern bool disassemble(const uint8_t *packet, uint32_t len, RipPacket *output);
  */
 extern uint32_t assemble(const RipPacket *rip, uint8_t *buffer);
 
+/**
+ * @brief 在转发缓存中查找目的地址，命中时给出邻接编号
+ * @return 命中且路由表没有变化过则返回 true
+ */
+extern bool cache_lookup(uint32_t addr, uint32_t *adj);
+// 把查表得到的邻接编号写入转发缓存
+extern void cache_fill(uint32_t addr, uint32_t adj);
+// 清空转发缓存
+extern void cache_flush();
+// 转发缓存的命中、未命中和因路由表变化失效的次数
+extern void cache_stats(uint64_t *hit, uint64_t *miss, uint64_t *stale);
+
+/**
+ * @brief 取得 (nexthop, if_index) 对应的邻接编号，不存在时新建
+ * @param nexthop 下一跳，直连路由时为目的地址本身，大端序
+ *
+ * 邻接表满时会清空邻接表和转发缓存，之前取得的编号全部作废。
+ */
+extern uint32_t adj_get(uint32_t nexthop, uint32_t if_index);
+/**
+ * @brief 取出邻接的 nexthop、if_index 和 MAC 地址
+ * @return MAC 地址已解析时返回 true ，否则由 HAL 发出 ARP 请求并返回 false
+ */
+extern bool adj_resolve(uint32_t adj, uint32_t *nexthop, uint32_t *if_index, macaddr_t mac);
+// ARP 表变化时更新对应的邻接，注册为 HAL 的回调
+extern void adj_learn(int if_index, in_addr_t ip, const uint8_t *mac);
+
+/**
+ * @brief 设置 key 对应的定时器在 expire 时刻（毫秒，和 HAL_GetTicks 相同）到期，已有时改为新的到期时间
+ *
+ * 插入、取消和刷新都是 O(1) ，到期的定时器由 timer_poll 取出后自动删除。
+ */
+extern void timer_set(uint64_t key, uint64_t expire);
+// 取消定时器，不存在时返回 false
+extern bool timer_cancel(uint64_t key);
+// key 是否有还没到期的定时器
+extern bool timer_pending(uint64_t key);
+// 设置时间轮的当前时刻，在设置定时器前调用
+extern void timer_init(uint64_t now);
+// 把到 now 为止到期的定时器的 key 加到 expired 末尾
+extern void timer_poll(uint64_t now, std::vector<uint64_t> &expired);
+
+/**
+ * @brief 记录前缀的一次振荡（同一邻居显式撤销或改变 metric），加上 penalty 的惩罚
+ * @param key 前缀，同 route_key
+ * @return 前缀是否处于抑制状态
+ */
+extern bool damp_flap(uint64_t key, uint64_t now, uint32_t penalty);
+// 前缀是否处于抑制状态，惩罚衰减到足够低时解除
+extern bool damp_suppressed(uint64_t key, uint64_t now);
+// 有振荡记录的前缀数和其中被抑制的数目
+extern void damp_stats(size_t *tracked, size_t *suppressed);
+
+// 取得邻居 (addr, if_index) 的编号，不存在时新建
+extern uint32_t nbr_get(uint32_t addr, uint32_t if_index);
+// 收到邻居的响应时记下时刻
+extern void nbr_heard(uint32_t id, uint64_t now);
+// 在邻居的路由索引中加入/去掉一个前缀，key 同 route_key
+extern void nbr_attach(uint32_t id, uint64_t key);
+extern void nbr_detach(uint32_t id, uint64_t key);
+// 取出邻居通告的全部前缀并清空它的索引
+extern void nbr_take_routes(uint32_t id, std::vector<uint64_t> &keys);
+extern void nbr_get_info(uint32_t id, uint32_t *addr, uint32_t *if_index, uint64_t *last_heard, size_t *routes);
+extern size_t nbr_count();
+
+// 查找表是否从 2MB 大页分配，在建表前调用
+extern void set_huge_pages(bool enable);
+
 // 通过计算得到 checksum，大端序
 extern uint16_t get_header_checksum(uint8_t *packet);
 // 返回全部路由表项
 extern std::vector<RoutingTableEntry> get_all_entries();
+/**
+ * @brief 从游标处起取出至多 n 条路由表项，不分配内存
+ * @param cursor 第一次调用前置为 0 ，每次调用后向后推进
+ * @return 取出的条数，返回 0 表示已经取完
+ *
+ * 两次调用之间不能修改路由表。
+ */
+extern size_t next_entries(uint32_t *cursor, RoutingTableEntry *out, size_t n);
+// 路由表项的条数
+extern size_t get_entry_count();
+/**
+ * @brief 路由表按存放位置分成若干块，每块至多 RIP_MAX_ENTRY 条表项
+ *
+ * 块中的表项有变化（插入、删除、修改）时，块的版本号变成一个从未出现过的值，
+ * 用来缓存按块编码好的 RIP 包。
+ */
+extern size_t get_chunk_count();
+extern uint32_t get_chunk_version(size_t k);
+// 取出第 k 块中的表项，返回条数
+extern size_t get_chunk_entries(size_t k, RoutingTableEntry *out);
 // 返回改变了的路由表项
 extern std::vector<RoutingTableEntry> get_changed_entries();
 
@@ -111,57 +276,346 @@ static uint32_t get_len(uint32_t mask) {
 static constexpr uint32_t RIP_MULTI_ADDR = 0x090000e0;
 static constexpr uint16_t RIP_PORT = 0x0802;    // 520
 
-// 从 if_index 端口向 dst_addr 发送路由表项
-static void make_response(int if_index, in_addr_t dst_addr, const std::vector<RoutingTableEntry>& entries) {
-    if (entries.empty()) return;
+// ref. RFC2453 3.8，单位为毫秒
+static constexpr uint64_t ROUTE_TIMEOUT = 180 * 1000;
+static constexpr uint64_t GARBAGE_COLLECTION = 120 * 1000;
+
+// 定时器和振荡抑制的 key ：路由为 (addr, len) ，触发更新用一个不会和路由冲突的值
+static uint64_t prefix_key(uint32_t addr, uint32_t len) {
+    return uint64_t(addr & get_mask(len)) << 8 | len;
+}
+static uint64_t route_key(const RoutingTableEntry &rte) {
+    return prefix_key(rte.addr, rte.len);
+}
+static constexpr uint64_t TIMER_TRIGGERED = 1ull << 63;
+// 邻居存活的定时器，低位为邻居编号
+static constexpr uint64_t TIMER_NEIGHBOR = 1ull << 62;
+// 这么久没有收到邻居的响应就认为它失效了。按 RFC 2453 默认 30 秒定期更新的邻居（如 BIRD）算是错过三次；
+// 本路由器自己 regular_timer = 10 秒更新一次，同类邻居要错过九次，宁可晚一些也不误判按 30 秒更新的邻居
+static constexpr uint64_t NEIGHBOR_TIMEOUT = 90 * 1000;
+
+// 每次振荡的惩罚
+static constexpr uint32_t DAMP_WITHDRAW = 1000;     // 路由变为不可达
+static constexpr uint32_t DAMP_CHANGE = 500;        // 同一邻居改变 metric
+
+// 按 route_key 查找路由
+static bool find_route(uint64_t key, RoutingTableEntry &rte) {
+    return query(uint32_t(key >> 8), get_mask(key & 0xff), rte);
+}
+
+/**
+ * @brief 路由的定时器到期：超时的路由 metric 置为 16 并开始垃圾回收计时，垃圾回收到期的路由删除
+ * @return 路由变为不可达时返回 true ，需要触发更新
+ */
+static bool expire_route(uint64_t key, uint64_t time) {
+    RoutingTableEntry rte;
+    if (!find_route(key, rte)) return false;
+    // 邻居只是不说话，不算振荡，不加惩罚
+    if (ntohl(rte.metric) < 16) {
+        rte.metric = htonl(16);
+        rte.flag = true;
+        upsert(rte);
+        timer_set(key, time + GARBAGE_COLLECTION);
+        return true;
+    }
+    nbr_detach(nbr_get(rte.nexthop, rte.if_index), key);
+    update(false, rte);
+    return false;
+}
+
+// 端口发送路由时，对从这个端口学到的路由的处理
+enum horizon_t {
+    HORIZON_NONE,       // 照常发送
+    HORIZON_SPLIT,      // 不发送（水平分割）
+    HORIZON_POISON,     // metric 置为 16 发送（毒性逆转）
+};
+static const char *horizon_names[] = {"none", "split", "poison"};
+// 启动时由 -p 设置，之后不再改变（缓存的响应按它编码）
+static horizon_t horizon[N_IFACE_ON_BOARD] = {HORIZON_POISON, HORIZON_POISON, HORIZON_POISON, HORIZON_POISON};
+
+/*
+  RIP 响应的流式编码器：IP 、UDP 和 RIP 头在 begin 时写一次，表项直接写进发送缓冲区，
+  凑满 RIP_MAX_ENTRY 条就发出去，下一个包沿用同一个头。
+  各个包的头只有长度不同，IP 校验和由固定部分的和加上总长度增量算出。
+  写入表项时按端口的 horizon 设置处理从该端口学到的路由，不需要先复制一份表。
+*/
+struct RipEncoder {
+    static constexpr size_t HEADER = 20 + 8 + 4;    // IP 、UDP 和 RIP 头
+
+    int if_index;
     macaddr_t dst_mac;
-    if (HAL_ArpGetMacAddress(if_index, dst_addr, dst_mac) == 0) {
-        output[0] = 0x45;                                   // ip: version, ihl
-        output[1] = 0;                                      // ip: TOS(DSCP/ECN)=0
-        *(uint16_t*)(output + 4) = 0;                       // ip: id = 0
-        *(uint16_t*)(output + 6) = 0;                       // ip: FLAGS/OFF=0
-        output[8] = 1;                                      // ip: ttl
-        output[9] = 0x11;                                   // ip: protocol = udp
-        *(in_addr_t*)(output + 12) = addrs[if_index];       // ip: src addr
-        *(in_addr_t*)(output + 16) = dst_addr;              // ip: dst addr
-        *(uint16_t*)(output + 20) = RIP_PORT;               // udp: src port
-        *(uint16_t*)(output + 22) = RIP_PORT;               // udp: dst port
-        *(uint16_t*)(output + 26) = htons(0);               // udp: checksum = 0
-        for (unsigned i = 0; i < entries.size(); i += RIP_MAX_ENTRY) {
-            RipPacket rip;
-            rip.command = rip_command_t::RESPONSE;
-            rip.numEntries = std::min(size_t(RIP_MAX_ENTRY), entries.size() - i);
-            for (unsigned j = 0; j < rip.numEntries; j++) {
-                auto &rte = entries[i + j];
-                auto &entry = rip.entries[j];
-                entry.addr = rte.addr;
-                entry.metric = rte.metric;
-                entry.mask = get_mask(rte.len);
-                entry.nexthop = rte.nexthop;
+    uint32_t n;                 // 缓冲区中的表项数
+    uint32_t header_sum;        // IP 头中除总长度和校验和以外的 16 位字之和
+    uint8_t buffer[HEADER + RIP_MAX_ENTRY * 20];
+
+    void begin(int if_index, in_addr_t dst_addr, const macaddr_t dst_mac) {
+        this->if_index = if_index;
+        memcpy(this->dst_mac, dst_mac, sizeof(macaddr_t));
+        n = 0;
+        memset(buffer, 0, HEADER);
+        buffer[0] = 0x45;                                   // ip: version, ihl
+        buffer[8] = 1;                                      // ip: ttl
+        buffer[9] = 0x11;                                   // ip: protocol = udp
+        memcpy(buffer + 12, &addrs[if_index], 4);           // ip: src addr
+        memcpy(buffer + 16, &dst_addr, 4);                  // ip: dst addr
+        *(uint16_t*)(buffer + 20) = RIP_PORT;               // udp: src port
+        *(uint16_t*)(buffer + 22) = RIP_PORT;               // udp: dst port
+        buffer[28] = rip_command_t::RESPONSE;               // rip: command
+        buffer[29] = 2;                                     // rip: version
+        // 反码和与字节序无关，按本机序相加即可
+        header_sum = 0;
+        for (int i = 0; i < 20; i += 2) header_sum += *(uint16_t*)(buffer + i);
+    }
+
+    // 返回是否写入了（水平分割时从本端口学到的路由不写）
+    bool append(const RoutingTableEntry &rte) {
+        uint32_t metric = rte.metric;
+        if (rte.if_index == uint32_t(if_index)) {
+            if (horizon[if_index] == HORIZON_SPLIT) return false;
+            if (horizon[if_index] == HORIZON_POISON) metric = htonl(16);
+        }
+        put(rte, metric);
+        return true;
+    }
+
+    // 按给出的 metric（大端序）写入，不按 horizon 处理
+    void put(const RoutingTableEntry &rte, uint32_t metric) {
+        uint8_t *entry = buffer + HEADER + n * 20;
+        uint32_t family_tag = htonl(2 << 16);
+        uint32_t mask = get_mask(rte.len);
+        memcpy(entry, &family_tag, 4);
+        memcpy(entry + 4, &rte.addr, 4);
+        memcpy(entry + 8, &mask, 4);
+        memcpy(entry + 12, &rte.nexthop, 4);
+        memcpy(entry + 16, &metric, 4);
+        n++;
+    }
+
+    void add(const RoutingTableEntry &rte) {
+        if (append(rte) && n == RIP_MAX_ENTRY) flush();
+    }
+
+    static uint16_t fold(uint32_t sum) {
+        sum = (sum & 0xffff) + (sum >> 16);
+        sum = (sum & 0xffff) + (sum >> 16);
+        return ~sum;
+    }
+
+    // 写好长度和校验和，返回包长
+    uint16_t finish() {
+        uint16_t len = HEADER + n * 20;
+        *(uint16_t*)(buffer + 2) = htons(len);                  // ip: total length
+        *(uint16_t*)(buffer + 24) = htons(len - 20);            // udp: length
+        *(uint16_t*)(buffer + 10) = fold(header_sum + htons(len));  // ip: checksum
+        return len;
+    }
+
+    // 返回是否发出了包，缓冲区为空或发送失败时返回 false
+    bool flush() {
+        if (!n) return false;
+        int ret = HAL_SendIPPacket(if_index, buffer, finish(), dst_mac);
+        n = 0;
+        return ret == 0;
+    }
+};
+
+/*
+  每个端口缓存编码好的整表响应，第 k 个包对应路由表的第 k 块表项，
+  块的版本号没变时直接重发，只有变了的块重新编码，各端口共用一次取出的表项。
+  目的地址在发送时填入，校验和由缓存的部分和加上目的地址得到。
+*/
+struct ResponseCache {
+    struct packet_t {
+        uint32_t version;       // 编码时块的版本号，0 表示还没有编码
+        uint16_t len;           // 0 表示这一块没有要发送的表项
+        uint32_t sum;           // IP 头中除目的地址和校验和以外的 16 位字之和
+        uint8_t data[RipEncoder::HEADER + RIP_MAX_ENTRY * 20];
+    };
+    std::vector<packet_t> packets[N_IFACE_ON_BOARD];
+
+    // 更新 wanted 中为 true 的端口的缓存
+    void refresh(const bool wanted[N_IFACE_ON_BOARD]) {
+        size_t count = get_chunk_count();
+        for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+            if (wanted[i]) packets[i].resize(count);
+        }
+        RoutingTableEntry chunk[RIP_MAX_ENTRY];
+        static const macaddr_t no_mac = {};
+        for (size_t k = 0; k < count; k++) {
+            auto version = get_chunk_version(k);
+            size_t n = 0;
+            bool fetched = false;
+            for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+                if (!wanted[i] || packets[i][k].version == version) continue;
+                if (!fetched) {
+                    n = get_chunk_entries(k, chunk);
+                    fetched = true;
+                }
+                auto &packet = packets[i][k];
+                RipEncoder encoder;
+                encoder.begin(i, 0, no_mac);
+                for (size_t j = 0; j < n; j++) encoder.append(chunk[j]);
+                packet.version = version;
+                packet.len = encoder.n ? encoder.finish() : 0;
+                packet.sum = encoder.header_sum + htons(packet.len);
+                memcpy(packet.data, encoder.buffer, packet.len);
             }
-            auto rip_len = assemble(&rip, output + 20 + 8);
-            *(uint16_t*)(output + 24) = htons(8 + rip_len);                     // udp: length = 8 + rip_len
-            *(uint16_t*)(output + 2) = htons(20 + 8 + rip_len);                 // ip: total length
-            *(uint16_t*)(output + 10) = get_header_checksum(output);            // ip: checksum
-            HAL_SendIPPacket(if_index, output, 20 + 8 + rip_len, dst_mac);
         }
     }
-}
 
-// 组播发送路由表
-static void multicast(const std::vector<RoutingTableEntry>& entries) {
+    // 有包发送失败时返回 false
+    bool send(int if_index, in_addr_t dst_addr, macaddr_t dst_mac) {
+        uint32_t dst_sum = (dst_addr & 0xffff) + (dst_addr >> 16);
+        bool ok = true;
+        for (auto &packet: packets[if_index]) {
+            if (!packet.len) continue;
+            memcpy(packet.data + 16, &dst_addr, 4);                                 // ip: dst addr
+            *(uint16_t*)(packet.data + 10) = RipEncoder::fold(packet.sum + dst_sum);   // ip: checksum
+            if (HAL_SendIPPacket(if_index, packet.data, packet.len, dst_mac) < 0) ok = false;
+        }
+        return ok;
+    }
+};
+static ResponseCache responses;
+
+/**
+ * @brief 发送整个路由表，if_index 为 -1 时向每个端口组播，否则从 if_index 单播给 dst_addr
+ *
+ * 都按端口的 horizon 设置处理（RFC 2453 3.9.1 中对整表请求的回应和定期更新一样处理），
+ * 发送的是缓存中的包。
+ * @return 发送失败的端口的掩码
+ */
+static int send_table(int if_index, in_addr_t dst_addr) {
+    macaddr_t dst_mac[N_IFACE_ON_BOARD];
+    bool reachable[N_IFACE_ON_BOARD] = {};
     for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
-        if (!update) {
-            make_response(i, RIP_MULTI_ADDR, entries);
-        } else {
-            std::vector<RoutingTableEntry> cur;
-            for (auto &entry: entries) {
-                cur.push_back(entry);
-                if (i == entry.if_index) cur.back().metric = htonl(16);
+        if (if_index >= 0 && i != if_index) continue;
+        reachable[i] = HAL_ArpGetMacAddress(i, dst_addr, dst_mac[i]) == 0;
+    }
+    responses.refresh(reachable);
+    int failed = 0;
+    for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+        if (reachable[i] && !responses.send(i, dst_addr, dst_mac[i])) failed |= 1 << i;
+    }
+    return failed;
+}
+
+/*
+  触发更新的调度 ref. RFC2453 3.10.1
+  路由变化时只记下前缀，同一前缀多次变化只记一次。第一次变化后等 WINDOW 毫秒
+  （且距上一次触发更新至少 hold 毫秒）再把这段时间内变化的前缀一起交给各端口。
+  各端口按 rate 限速组播，每个包在发出时才从路由表取表项，内容总是最新的，
+  排队期间又变化的前缀也不会重复发送。
+*/
+struct TriggeredUpdates {
+    static constexpr uint64_t WINDOW = 200;
+    static constexpr uint32_t MAX_RATE = 1000;  // 包的间隔按毫秒计，再高就是 0 ，等于不限速
+
+    struct port_t {
+        std::deque<uint64_t> keys;              // 待发送的前缀
+        std::unordered_set<uint64_t> queued;    // keys 中已有的前缀
+        uint64_t next = 0;                      // 下一个包最早的发送时刻
+    };
+    std::vector<uint64_t> changed;              // 等待合并的前缀
+    std::unordered_set<uint64_t> seen;
+    port_t ports[N_IFACE_ON_BOARD];
+    uint32_t rate[N_IFACE_ON_BOARD] = {100, 100, 100, 100};  // 每秒最多发送的包数，0 表示不限速
+    uint64_t last = 0, hold = 0;
+    uint64_t due = 0;                           // 合并窗口结束的时刻
+
+    void note(uint64_t key, uint64_t time) {
+        if (!seen.insert(key).second) return;
+        changed.push_back(key);
+        if (!timer_pending(TIMER_TRIGGERED)) {
+            due = std::max(time + WINDOW, last + hold);
+            timer_set(TIMER_TRIGGERED, due);
+        }
+    }
+
+    // 合并窗口结束，下一次触发更新至少在 hold 毫秒后
+    void release(uint64_t time, uint64_t hold) {
+        for (auto &port: ports) {
+            for (auto key: changed) {
+                if (port.queued.insert(key).second) port.keys.push_back(key);
+            }
+        }
+        changed.clear();
+        seen.clear();
+        last = time;
+        this->hold = hold;
+    }
+
+    // 刚发送过整个路由表，还没发出的变化都不用再发
+    void clear() {
+        for (auto &port: ports) {
+            port.keys.clear();
+            port.queued.clear();
+        }
+        changed.clear();
+        seen.clear();
+        timer_cancel(TIMER_TRIGGERED);
+        hold = 0;
+    }
+
+    // 发出到时间的包，返回距下一个包可以发出或合并窗口结束的毫秒数，都没有时返回 -1
+    int64_t pump(uint64_t time) {
+        int64_t wait = changed.empty() ? -1 : std::max<int64_t>(due - time, 0);
+        for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+            auto &port = ports[i];
+            if (port.keys.empty()) continue;
+            macaddr_t dst_mac;
+            if (HAL_ArpGetMacAddress(i, RIP_MULTI_ADDR, dst_mac) != 0) {
+                port.keys.clear();
+                port.queued.clear();
+                continue;
+            }
+            while (!port.keys.empty() && port.next <= time) {
+                RipEncoder encoder;
+                encoder.begin(i, RIP_MULTI_ADDR, dst_mac);
+                while (!port.keys.empty() && encoder.n < RIP_MAX_ENTRY) {
+                    auto key = port.keys.front();
+                    port.keys.pop_front();
+                    port.queued.erase(key);
+                    RoutingTableEntry rte;
+                    // 已经被垃圾回收的路由不再发送
+                    if (find_route(key, rte)) encoder.append(rte);
+                }
+                // 水平分割后一项也没有时没有发包，不占用这个端口的发送速率
+                if (encoder.flush() && rate[i]) port.next = time + 1000 / rate[i];
+            }
+            if (!port.keys.empty()) {
+                int64_t left = port.next - time;
+                if (wait < 0 || left < wait) wait = left;
             }
-            make_response(i, RIP_MULTI_ADDR, cur);
         }
+        return wait;
     }
+};
+static TriggeredUpdates triggers;
+
+/**
+ * @brief 回应查询指定表项的请求 ref. RFC2453 3.9.1
+ *
+ * 逐项按 (addr, mask) 精确查找，把 metric 填好按请求的顺序发回，没有的路由填 16 。
+ * 这种请求一般用于诊断，不做水平分割处理。
+ */
+static void answer_request(const RipView &rip, int if_index, in_addr_t dst_addr) {
+    macaddr_t dst_mac;
+    if (HAL_ArpGetMacAddress(if_index, dst_addr, dst_mac) != 0) return;
+    RipEncoder encoder;
+    encoder.begin(if_index, dst_addr, dst_mac);
+    for (uint32_t i = 0; i < rip.numEntries; i++) {
+        RoutingTableEntry rte;
+        if (query(rip.addr(i), rip.mask(i), rte)) {
+            encoder.put(rte, rte.metric);
+        } else {
+            rte.addr = rip.addr(i);
+            rte.len = get_len(rip.mask(i));
+            rte.nexthop = 0;
+            encoder.put(rte, htonl(16));
+        }
+    }
+    encoder.flush();
 }
 
 static void multicast_request() {
@@ -193,6 +647,8 @@ static void multicast_request() {
 
 #include <random>
 #include <string>
+#include <time.h>
+#include <unistd.h>
 
 std::string ip_string(uint32_t addr) {
     std::string ret;
@@ -205,64 +661,232 @@ std::string ip_string(uint32_t addr) {
 
 std::mt19937 rng(time(0));
 
+/**
+ * @brief 邻居失效，按它的路由索引撤销它通告的路由，不遍历路由表
+ *
+ * 它是等价路径之一时只去掉这条路径，否则 metric 置为 16 并开始垃圾回收计时。
+ * 全部修改作为一批提交，变化由触发更新合并成一次发送。
+ */
+static void flush_neighbor(uint32_t id, uint64_t time) {
+    static std::vector<uint64_t> keys;
+    uint32_t addr, if_index;
+    uint64_t last_heard;
+    size_t count;
+    nbr_get_info(id, &addr, &if_index, &last_heard, &count);
+    nbr_take_routes(id, keys);
+    timer_cancel(TIMER_NEIGHBOR | id);
+    batch_begin();
+    for (auto key: keys) {
+        RoutingTableEntry rte;
+        if (!find_route(key, rte)) continue;
+        RoutingTableEntry path = rte;
+        path.nexthop = addr;
+        path.if_index = if_index;
+        if (remove_path(path)) continue;
+        if (rte.nexthop == addr && rte.if_index == if_index && ntohl(rte.metric) < 16) {
+            rte.metric = htonl(16);
+            rte.flag = true;
+            upsert(rte);
+            timer_set(key, time + GARBAGE_COLLECTION);
+        }
+    }
+    static std::vector<RoutingTableEntry> changed;
+    changed.clear();
+    batch_commit(changed);
+    for (auto &rte: changed) triggers.note(route_key(rte), time);
+    printf("neighbor %s lost, routes: %zu\n", ip_string(addr).c_str(), keys.size());
+}
+
+// 端口失效，撤销这个端口上所有邻居的路由
+static void flush_interface(uint32_t if_index, uint64_t time) {
+    for (uint32_t id = 0; id < nbr_count(); id++) {
+        uint32_t addr, nbr_if;
+        uint64_t last_heard;
+        size_t routes;
+        nbr_get_info(id, &addr, &nbr_if, &last_heard, &routes);
+        if (nbr_if == if_index && routes) flush_neighbor(id, time);
+    }
+}
+
+/*
+  端口链路状态由 HAL 在 HAL_ReceiveIPPacket 中回调通知，这时只记下来，回到主循环再处理。
+  链路断开时撤销这个端口上邻居的路由；恢复时立即在这个端口上组播整个路由表。
+  不能得知链路状态的后端（stdio、xilinx）只能靠定期发送整表失败来发现端口失效。
+*/
+static bool link_down[N_IFACE_ON_BOARD], link_restored[N_IFACE_ON_BOARD];
+
+static void link_changed(int if_index, int up) {
+    printf("link of interface %d is %s\n", if_index, up ? "up" : "down");
+    (up ? link_restored : link_down)[if_index] = true;
+}
+
+// 解析 -p 的参数 if:none|split|poison
+static bool set_horizon(const char *arg) {
+    int if_index;
+    char mode[8];
+    if (sscanf(arg, "%d:%7s", &if_index, mode) != 2 || if_index < 0 || if_index >= N_IFACE_ON_BOARD) return false;
+    for (int m = HORIZON_NONE; m <= HORIZON_POISON; m++) {
+        if (strcmp(mode, horizon_names[m]) == 0) {
+            horizon[if_index] = horizon_t(m);
+            return true;
+        }
+    }
+    return false;
+}
+
+// 解析 -r 的参数 if:pps ，端口发送触发更新的速率，0 表示不限速，最高 MAX_RATE
+static bool set_rate(const char *arg) {
+    int if_index, rate;
+    if (sscanf(arg, "%d:%d", &if_index, &rate) != 2 || if_index < 0 || if_index >= N_IFACE_ON_BOARD || rate < 0) return false;
+    if (uint32_t(rate) > TriggeredUpdates::MAX_RATE) return false;
+    triggers.rate[if_index] = rate;
+    return true;
+}
+
 int main(int argc, char *argv[]) {
+    const char *snapshot = nullptr;     // FIB 快照文件
+    int opt;
+    while ((opt = getopt(argc, argv, "s:e:Hp:r:")) != -1) {
+        switch (opt) {
+            case 's': snapshot = optarg; break;
+            case 'H': set_huge_pages(false); break;
+            case 'e':
+                if (select_engine(optarg)) break;
+                fprintf(stderr, "unknown engine %s\n", optarg);
+                return 1;
+            case 'p':
+                if (set_horizon(optarg)) break;
+                fprintf(stderr, "bad horizon %s\n", optarg);
+                return 1;
+            case 'r':
+                if (set_rate(optarg)) break;
+                fprintf(stderr, "bad rate %s\n", optarg);
+                return 1;
+            default:
+                fprintf(stderr, "usage: %s [-s snapshot] [-e [ortc-]trie|dir24|bsl] [-H] [-p if:none|split|poison]... [-r if:pps]...\n", argv[0]);
+                return 1;
+        }
+    }
+    printf("forwarding engine: %s\n", get_engine_name());
+
     // 0a.
     int res = HAL_Init(0, addrs);
     if (res < 0) {
         return res;
     }
+    HAL_SetArpHandler(adj_learn);
+    HAL_SetLinkHandler(link_changed);
+    timer_init(HAL_GetTicks());
 
     // 0b. Add direct routes
+    RoutingTableEntry direct[N_IFACE_ON_BOARD];
     for (uint32_t i = 0; i < N_IFACE_ON_BOARD; i++) {
-        RoutingTableEntry entry = {
+        direct[i] = {
             .addr = addrs[i] & 0x00FFFFFF, // big endian
             .len = 24,        // small endian
             .if_index = i,    // small endian
             .nexthop = 0,      // big endian, means direct
             .metric = htonl(1)
         };
-        update(true, entry);
     }
+    // 有快照时直接用快照中的路由表（包含直连路由），重启后立即可以转发
+    if (snapshot && load_snapshot(snapshot)) {
+        printf("loaded snapshot %s\n", snapshot);
+        // 快照中学到的路由重新开始超时计时，并记入邻居的索引。
+        // next_entries 只读映射的快照，不会把它转成路由表，第一次修改前转发一直直接查快照
+        RoutingTableEntry chunk[RIP_MAX_ENTRY];
+        uint32_t cursor = 0;
+        uint64_t now = HAL_GetTicks();
+        while (size_t n = next_entries(&cursor, chunk, RIP_MAX_ENTRY)) {
+            for (size_t i = 0; i < n; i++) {
+                if (!chunk[i].nexthop) continue;
+                uint32_t nbr = nbr_get(chunk[i].nexthop, chunk[i].if_index);
+                nbr_attach(nbr, route_key(chunk[i]));
+                timer_set(route_key(chunk[i]), now + ROUTE_TIMEOUT);
+                timer_set(TIMER_NEIGHBOR | nbr, now + NEIGHBOR_TIMEOUT);
+            }
+        }
+    } else {
+        build(direct, N_IFACE_ON_BOARD);
+    }
+    uint32_t saved_generation = get_generation();
 
-    bool triggered = 0;
-    uint64_t triggered_last = 0, triggered_timer = 0;
     uint64_t last_time = 0;
     uint64_t regular_timer = 10;
+    std::vector<uint64_t> expired;
+    std::vector<uint32_t> lost_neighbors;
+    std::vector<RoutingTableEntry> batch_changes;
     while (1) {
         uint64_t time = HAL_GetTicks();
+        expired.clear();
+        timer_poll(time, expired);
+        bool triggered_due = false;
+        // 同时到期的路由作为一批修改，转发表引擎只整理一次；失效的邻居各自成批，放在后面处理
+        lost_neighbors.clear();
+        batch_begin();
+        for (auto key: expired) {
+            if (key == TIMER_TRIGGERED) {
+                triggered_due = true;
+            } else if (key & TIMER_NEIGHBOR) {
+                lost_neighbors.push_back(uint32_t(key));
+            } else if (expire_route(key, time)) {
+                printf("route timeout, addr: %s, len: %d\n", ip_string(uint32_t(key >> 8)).c_str(), int(key & 0xff));
+                triggers.note(key, time);
+            }
+        }
+        batch_changes.clear();
+        batch_commit(batch_changes);
+        for (auto id: lost_neighbors) flush_neighbor(id, time);
+        for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+            if (link_down[i]) flush_interface(i, time);
+            if (link_restored[i]) send_table(i, RIP_MULTI_ADDR);
+            link_down[i] = link_restored[i] = false;
+        }
         if (time > last_time + regular_timer * 1000) {
             // What to do? 
             // TODO: send complete routing table to every interface
             // ref. RFC2453 3.8
-            auto all = get_all_entries();
             printf("route table(addr, len, nexthop, metric):\n");
-            printf("tot: %u\n", all.size());
-            for (int i = 0; i < std::min(12, int(all.size())); i++) {
-                auto &e = all[i];
+            printf("tot: %zu\n", get_entry_count());
+            RoutingTableEntry head[12];
+            uint32_t cursor = 0;
+            size_t n = next_entries(&cursor, head, 12);
+            for (size_t i = 0; i < n; i++) {
+                auto &e = head[i];
                 printf("%s %d %s %d\n", ip_string(e.addr).c_str(), e.len, ip_string(e.nexthop).c_str(), ntohl(e.metric));
             }
-            multicast(all);
+            // 发送失败的端口也当作失效，没有链路状态通知的后端只能这样发现
+            int failed = send_table(-1, RIP_MULTI_ADDR);
+            for (int i = 0; i < N_IFACE_ON_BOARD; i++) {
+                if (failed >> i & 1) flush_interface(i, time);
+            }
+            uint64_t hit, miss, stale;
+            cache_stats(&hit, &miss, &stale);
+            printf("cache hit: %llu, miss: %llu (stale: %llu), hit rate: %.2f%%\n", (unsigned long long)hit,
+                   (unsigned long long)miss, (unsigned long long)stale, hit + miss ? 100.0 * hit / (hit + miss) : 0.0);
+            size_t tracked, suppressed;
+            damp_stats(&tracked, &suppressed);
+            printf("flapping prefixes: %zu, suppressed: %zu\n", tracked, suppressed);
+            if (snapshot && saved_generation != get_generation()) {
+                saved_generation = get_generation();
+                if (!save_snapshot(snapshot)) printf("failed to save snapshot %s\n", snapshot);
+            }
             printf("regular %d s Timer\n", int(regular_timer));
             last_time = time;
-            triggered = false;
-            triggered_timer = 0;
-        } else if (triggered && time - triggered_last > triggered_timer) {
+            triggers.clear();
+        } else if (triggered_due) {
             printf("triggered udpate\n");
-            auto entries = get_changed_entries();
-            multicast(entries);
-            for (auto &entry: entries) {
-                if (ntohl(entry.metric) == 16) update(false, entry);
-            }
-            triggered_last = time;
-            triggered_timer = rng() % 4000 + 1000;  // between 1s and 5s
-            triggered = false;
+            triggers.release(time, rng() % 4000 + 1000);  // between 1s and 5s
         }
+        // 等待时间不超过下一个包的发送时刻和合并窗口结束的时刻
+        int64_t wait = triggers.pump(time);
+        if (wait < 0 || wait > 1000) wait = 1000;
 
         int mask = (1 << N_IFACE_ON_BOARD) - 1;
         macaddr_t src_mac;
         macaddr_t dst_mac;
         int if_index;
-        res = HAL_ReceiveIPPacket(mask, packet, sizeof(packet), src_mac, dst_mac, 1000, &if_index);
+        res = HAL_ReceiveIPPacket(mask, packet, sizeof(packet), src_mac, dst_mac, wait, &if_index);
         if (res == HAL_ERR_EOF) {
             break;
         } else if (res < 0) {
@@ -299,14 +923,19 @@ int main(int argc, char *argv[]) {
 
         if (dst_is_me) {
             // 3a.1
-            RipPacket rip;
+            RipView rip;
             // check and validate
-            if (disassemble(packet, res, &rip)) {
+            if (parse_rip(packet, res, &rip)) {
                 if (rip.command == rip_command_t::REQUEST) {
                     // 3a.3 request, ref. RFC2453 3.9.1
-                    // only need to respond to whole table requests in the lab
-                    make_response(if_index, src_addr, get_all_entries());
-                    printf("response to request\n");
+                    // 只有一项且 addr 、mask 为 0 、metric 为 16 时是请求整个路由表
+                    if (rip.numEntries == 1 && !rip.addr(0) && !rip.mask(0) && ntohl(rip.metric(0)) == 16) {
+                        send_table(if_index, src_addr);
+                        printf("response to request\n");
+                    } else {
+                        answer_request(rip, if_index, src_addr);
+                        printf("response to specific request, entries: %d\n", int(rip.numEntries));
+                    }
                 } else {
                     // 3a.2 response, ref. RFC2453 3.9.2
                     // update routing table
@@ -316,13 +945,20 @@ int main(int argc, char *argv[]) {
                     // TODO: use query and update
                     // triggered updates? ref. RFC2453 3.10.1
                     printf("received response\n");
+                    uint32_t nbr = nbr_get(src_addr, if_index);
+                    nbr_heard(nbr, time);
+                    timer_set(TIMER_NEIGHBOR | nbr, time + NEIGHBOR_TIMEOUT);
+                    // 整个响应作为一批修改，得到的变化交给触发更新
+                    batch_begin();
                     uint32_t nexthop, metric, addr;
                     for (int i = 0; i < rip.numEntries; i++) {
-                        auto &re = rip.entries[i];
+                        auto re = rip.entry(i);
                         if (re.addr == 0) re.addr = src_addr;
                         if (re.nexthop == 0) re.nexthop = src_addr;
                         uint32_t new_metric = htonl(std::min(ntohl(re.metric) + 1, 16u));
                         // printf("new metric: %u\n", ntohl(new_metric));
+                        // 被抑制的前缀不接受可达的通告，撤销仍然照常处理
+                        if (ntohl(new_metric) < 16 && damp_suppressed(prefix_key(re.addr, get_len(re.mask)), time)) continue;
                         RoutingTableEntry rte;
                         if (!query(re.addr, re.mask, rte)) {
                             // there is no point in adding a route which is unusable
@@ -335,21 +971,53 @@ int main(int argc, char *argv[]) {
                                 rte.nexthop = src_addr;
                                 rte.metric = new_metric;
                                 rte.flag = true;
-                                triggered = true;
-                                update(true, rte);
+                                upsert(rte);
+                                nbr_attach(nbr, route_key(rte));
+                                timer_set(route_key(rte), time + ROUTE_TIMEOUT);
                             }
                         } else {
-                            if (rte.nexthop == src_addr && rte.metric != new_metric || ntohl(rte.metric) > ntohl(new_metric)) {
+                            RoutingTableEntry path = rte;
+                            path.nexthop = src_addr;
+                            path.if_index = if_index;
+                            if (ntohl(new_metric) > ntohl(rte.metric) && remove_path(path)) {
+                                // 等价路径中的一条变差了，路由仍走其余路径
+                                printf("remove equal-cost path, addr: %s, nexthop: %s\n", ip_string(rte.addr).c_str(), ip_string(src_addr).c_str());
+                                nbr_detach(nbr, route_key(rte));
+                            } else if (rte.nexthop == src_addr && rte.metric != new_metric || ntohl(rte.metric) > ntohl(new_metric)) {
+                                // 同一邻居撤销路由或改变 metric 算一次振荡，振荡太多时撤销路由直到抑制解除
+                                bool flap = rte.nexthop == src_addr && ntohl(rte.metric) < 16;
+                                if (flap && damp_flap(route_key(rte), time, ntohl(new_metric) == 16 ? DAMP_WITHDRAW : DAMP_CHANGE)) {
+                                    new_metric = htonl(16);
+                                }
                                 printf("update route table entry, addr: %s, metric: %d\n", ip_string(rte.addr).c_str(), int(ntohl(new_metric)));
+                                if (rte.nexthop != src_addr || rte.if_index != uint32_t(if_index)) {
+                                    nbr_detach(nbr_get(rte.nexthop, rte.if_index), route_key(rte));
+                                }
+                                nbr_attach(nbr, route_key(rte));
                                 rte.metric = new_metric;
                                 rte.nexthop = src_addr;
                                 rte.if_index = if_index;
                                 rte.flag = true;
-                                triggered = true;
-                                update(true, rte);
+                                bool changed = upsert(rte);
+                                if (ntohl(new_metric) < 16) {
+                                    timer_set(route_key(rte), time + ROUTE_TIMEOUT);
+                                } else if (changed) {
+                                    // 邻居通告不可达，开始删除过程 ref. RFC2453 3.9.2
+                                    timer_set(route_key(rte), time + GARBAGE_COLLECTION);
+                                }
+                            } else if (rte.metric == new_metric && ntohl(new_metric) < 16) {
+                                // 同样 metric 的通告说明路由仍然有效，重新开始超时计时
+                                timer_set(route_key(rte), time + ROUTE_TIMEOUT);
+                                if (add_path(path)) {
+                                    nbr_attach(nbr, route_key(rte));
+                                    printf("add equal-cost path, addr: %s, nexthop: %s\n", ip_string(rte.addr).c_str(), ip_string(src_addr).c_str());
+                                }
                             }
                         }
                     }
+                    batch_changes.clear();
+                    batch_commit(batch_changes);
+                    for (auto &rte: batch_changes) triggers.note(route_key(rte), time);
                 }
             } else {
                 printf("not rip\n");
@@ -358,16 +1026,24 @@ int main(int argc, char *argv[]) {
             // 3b.1 dst is not me
             // forward
             // beware of endianness
-            uint32_t nexthop, dest_if;
-            if (query(dst_addr, &nexthop, &dest_if)) {
+            uint32_t nexthop, dest_if, adj;
+            macaddr_t dest_mac;
+            // 缓存中的邻接已经处理过直连路由
+            bool cached = cache_lookup(dst_addr, &adj);
+            bool multipath = false;
+            if (cached || query_flow(dst_addr, flow_hash(packet, res), &nexthop, &dest_if, &multipath)) {
                 // printf("dst: %s, nexthop: %s, dest if: %d\n", ip_string(dst_addr).c_str(), ip_string(nexthop).c_str(), dest_if);
                 // found
-                // direct routing
-                if (nexthop == 0) {
-                    nexthop = dst_addr;
+                if (!cached) {
+                    // direct routing
+                    if (nexthop == 0) {
+                        nexthop = dst_addr;
+                    }
+                    adj = adj_get(nexthop, dest_if);
+                    // 多路径的结果取决于整个五元组，不能按目的地址缓存
+                    if (!multipath) cache_fill(dst_addr, adj);
                 }
-                macaddr_t dest_mac;
-                if (HAL_ArpGetMacAddress(dest_if, nexthop, dest_mac) == 0) {
+                if (adj_resolve(adj, &nexthop, &dest_if, dest_mac)) {
                     // found
                     memcpy(output, packet, res);
                     // update ttl and checksum
@@ -0,0 +1,68 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+
+/*
+  邻居表：每个 (addr, if_index) 一条记录，保存最后一次收到它的响应的时刻
+  和它通告给我们的路由（以它为主路径或等价路径之一的前缀，key 同 route_key）。
+  邻居失效时按这个索引撤销它的路由，只需要访问这些路由本身。
+  编号从 0 开始，记录不删除：邻居只能是直连网段上说 RIP 的路由器，数目有限，
+  失效后再出现时沿用原来的编号，定时器的 key 中的编号也不会指向别的邻居。
+  失效时放掉它的路由索引占的内存，只留下地址和端口。
+*/
+struct NeighborTable {
+    struct neighbor_t {
+        uint32_t addr;
+        uint32_t if_index;
+        uint64_t last_heard;
+        std::unordered_set<uint64_t> routes;
+    };
+    std::vector<neighbor_t> neighbors;
+    std::unordered_map<uint64_t, uint32_t> ids;    // (addr, if_index) -> 编号
+
+    uint32_t get(uint32_t addr, uint32_t if_index) {
+        auto it = ids.find(uint64_t(addr) << 32 | if_index);
+        if (it != ids.end()) return it->second;
+        uint32_t id = neighbors.size();
+        ids[uint64_t(addr) << 32 | if_index] = id;
+        neighbors.push_back(neighbor_t{addr, if_index, 0, {}});
+        return id;
+    }
+};
+static NeighborTable neighbors;
+
+uint32_t nbr_get(uint32_t addr, uint32_t if_index) {
+    return neighbors.get(addr, if_index);
+}
+
+void nbr_heard(uint32_t id, uint64_t now) {
+    neighbors.neighbors[id].last_heard = now;
+}
+
+void nbr_attach(uint32_t id, uint64_t key) {
+    neighbors.neighbors[id].routes.insert(key);
+}
+
+void nbr_detach(uint32_t id, uint64_t key) {
+    neighbors.neighbors[id].routes.erase(key);
+}
+
+void nbr_take_routes(uint32_t id, std::vector<uint64_t> &keys) {
+    auto &routes = neighbors.neighbors[id].routes;
+    keys.assign(routes.begin(), routes.end());
+    std::unordered_set<uint64_t>().swap(routes);
+}
+
+void nbr_get_info(uint32_t id, uint32_t *addr, uint32_t *if_index, uint64_t *last_heard, size_t *routes) {
+    auto &n = neighbors.neighbors[id];
+    *addr = n.addr;
+    *if_index = n.if_index;
+    *last_heard = n.last_heard;
+    *routes = n.routes.size();
+}
+
+size_t nbr_count() {
+    return neighbors.neighbors.size();
+}
@@ -0,0 +1,140 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <unordered_map>
+
+/*
+  分层时间轮：每层 SLOTS 个槽，第 0 层一个槽是 1 ms（HAL_GetTicks 的单位），
+  第 l 层一个槽是 SLOTS^l ms ，四层共能表示约 4.6 小时以内的超时。
+  定时器按到期时间离现在的远近放进某一层的槽里，槽是双向链表，
+  插入、取消、刷新都是 O(1) ；低层转完一圈时把高层对应槽中的定时器下放一层。
+  定时器用调用者给的 64 位 key 标识，同一个 key 只有一个定时器。
+*/
+struct TimerWheel {
+    static constexpr int LEVELS = 4;
+    static constexpr int BITS = 6;
+    static constexpr int SLOTS = 1 << BITS;
+    static constexpr uint64_t RANGE = 1ull << (BITS * LEVELS);
+    static constexpr uint32_t HEADS = LEVELS * SLOTS;   // 结点 0 .. HEADS-1 是各个槽的链表头
+
+    struct node_t {
+        uint64_t key;
+        uint64_t expire;
+        uint32_t prev, next;
+    };
+    std::vector<node_t> nodes;
+    std::vector<uint32_t> free_nodes;
+    std::unordered_map<uint64_t, uint32_t> ids;     // key -> 结点
+    uint64_t current = 0;                           // 已经处理到的时刻
+
+    TimerWheel() : nodes(HEADS) {
+        for (uint32_t h = 0; h < HEADS; h++) nodes[h].prev = nodes[h].next = h;
+    }
+
+    void link(uint32_t head, uint32_t x) {
+        nodes[x].prev = nodes[head].prev;
+        nodes[x].next = head;
+        nodes[nodes[head].prev].next = x;
+        nodes[head].prev = x;
+    }
+
+    void unlink(uint32_t x) {
+        nodes[nodes[x].prev].next = nodes[x].next;
+        nodes[nodes[x].next].prev = nodes[x].prev;
+    }
+
+    // 按 expire 离 base 的距离选层，base 是下一个要处理的时刻
+    void place(uint32_t x, uint64_t base) {
+        auto expire = nodes[x].expire;
+        uint64_t delta = expire > base ? expire - base : 0;
+        int level = 0;
+        while (level < LEVELS - 1 && delta >= 1ull << (BITS * (level + 1))) level++;
+        if (!delta) expire = base;
+        link(level * SLOTS + (expire >> (BITS * level) & (SLOTS - 1)), x);
+    }
+
+    void set(uint64_t key, uint64_t expire) {
+        if (expire <= current) expire = current + 1;
+        if (expire - current >= RANGE) expire = current + RANGE - 1;
+        auto &id = ids[key];
+        if (id) {
+            unlink(id);
+        } else if (!free_nodes.empty()) {
+            id = free_nodes.back();
+            free_nodes.pop_back();
+        } else {
+            id = nodes.size();
+            nodes.push_back(node_t());
+        }
+        nodes[id].key = key;
+        nodes[id].expire = expire;
+        place(id, current + 1);
+    }
+
+    bool cancel(uint64_t key) {
+        auto it = ids.find(key);
+        if (it == ids.end()) return false;
+        unlink(it->second);
+        free_nodes.push_back(it->second);
+        ids.erase(it);
+        return true;
+    }
+
+    // 把 head 中的定时器重新按 base 放置
+    void cascade(uint32_t head, uint64_t base) {
+        uint32_t x = nodes[head].next;
+        nodes[head].prev = nodes[head].next = head;
+        while (x != head) {
+            uint32_t next = nodes[x].next;
+            place(x, base);
+            x = next;
+        }
+    }
+
+    void poll(uint64_t now, std::vector<uint64_t> &expired) {
+        // 没有定时器时直接跳到 now
+        if (ids.empty() && now > current) current = now;
+        while (current < now) {
+            uint64_t t = current + 1;
+            for (int level = LEVELS - 1; level > 0; level--) {
+                if (t & ((1ull << (BITS * level)) - 1)) continue;
+                cascade(level * SLOTS + (t >> (BITS * level) & (SLOTS - 1)), t);
+            }
+            uint32_t head = t & (SLOTS - 1);
+            while (nodes[head].next != head) {
+                uint32_t x = nodes[head].next;
+                unlink(x);
+                expired.push_back(nodes[x].key);
+                ids.erase(nodes[x].key);
+                free_nodes.push_back(x);
+            }
+            current = t;
+            if (ids.empty()) current = now;
+        }
+    }
+};
+static TimerWheel timers;
+
+void timer_init(uint64_t now) {
+    timers.current = now;
+}
+
+void timer_set(uint64_t key, uint64_t expire) {
+    timers.set(key, expire);
+}
+
+bool timer_cancel(uint64_t key) {
+    return timers.cancel(key);
+}
+
+bool timer_pending(uint64_t key) {
+    return timers.ids.count(key) != 0;
+}
+
+size_t timer_count() {
+    return timers.ids.size();
+}
+
+void timer_poll(uint64_t now, std::vector<uint64_t> &expired) {
+    timers.poll(now, expired);
+}
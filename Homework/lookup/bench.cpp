@@ -0,0 +1,432 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include <arpa/inet.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#include "router.h"
+
+extern void update(bool insert, RoutingTableEntry entry);
+extern bool query(uint32_t addr, uint32_t *nexthop, uint32_t *if_index);
+extern void build(const RoutingTableEntry *entries, size_t n);
+extern void query_batch(const uint32_t *addr, int n, uint32_t *nexthop, uint32_t *if_index, bool *found);
+extern size_t get_memory_usage();
+extern bool select_engine(const char *name);
+extern const char *get_engine_name(size_t i);
+extern void set_huge_pages(bool enable);
+extern void huge_stats(size_t *hugetlb, size_t *thp, size_t *small);
+extern bool query(uint32_t addr, uint32_t mask, RoutingTableEntry &entry);
+extern std::vector<RoutingTableEntry> get_all_entries();
+extern size_t next_entries(uint32_t *cursor, RoutingTableEntry *out, size_t n);
+extern size_t get_entry_count();
+extern size_t get_chunk_count();
+extern size_t get_chunk_entries(size_t k, RoutingTableEntry *out);
+extern bool save_snapshot(const char *path);
+extern bool load_snapshot(const char *path);
+extern bool is_snapshot_mapped();
+extern void batch_begin();
+extern size_t batch_commit(std::vector<RoutingTableEntry> &changed);
+// duck.cpp 的接口，它有自己的路由表
+extern void init(int n, int q, const RoutingTableEntry *a);
+extern unsigned query(unsigned addr);
+extern void query_all(int q, const unsigned *addr, unsigned *result);
+
+// 路由查询的性能测试：
+//   ./bench [-n 查询次数] [-e 引擎]... [-H on|off|both] [-s 前缀数]... [前缀文件...]
+// 不指定引擎时依次测试所有转发表引擎。
+// -s 生成给定数目的随机前缀（长度分布近似 BGP 表），用来测试大表。
+// 同时检查 build 和逐条 update 得到的转发结果相同、快照载入后的行为，
+// 检查 duck.cpp 的离线批量查询和逐个查询的结果相同，
+// 检查不通过时输出 FAILED ，退出码为 1 。
+// -H 选择查找表是否用 2MB 大页，both 时两种各测一遍，可以对比吞吐和 TLB 缺失。
+// 前缀文件可以是 BIRD 的静态路由配置（route a.b.c.d/len via "iface";），
+// 也可以是 SetupJoint/as4538_prefixes 这样的 JSON（"prefix":"a.b.c.d\/len"）。
+
+static const char *default_files[] = {
+    "../../Setup/conf-part9.conf",
+    "../../SetupJoint/conf-part8-r1.conf",
+    "../../SetupJoint/as4538_prefixes",
+};
+
+static bool failed = false;
+
+static const int BATCH = 32;    // 每批查询计时一次，时钟本身的开销摊到各次查询上
+static const uint32_t N_IFACE = 4;
+
+typedef std::chrono::steady_clock clock_type;
+
+static double elapsed_ns(clock_type::time_point begin, clock_type::time_point end) {
+    return std::chrono::duration<double, std::nano>(end - begin).count();
+}
+
+// 本进程用户态的 dTLB 读缺失计数，内核不允许（或不是 Linux）时为 -1
+static int open_tlb_counter() {
+#ifdef __linux__
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+static uint64_t read_counter(int fd) {
+    uint64_t value = 0;
+    if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value)) return 0;
+    return value;
+}
+
+static RoutingTableEntry make_entry(uint32_t a, uint32_t b, uint32_t c, uint32_t d, uint32_t len, uint32_t seq) {
+    uint32_t addr = a << 24 | b << 16 | c << 8 | d;
+    if (len < 32) addr &= ~(0xffffffffu >> len);
+    RoutingTableEntry entry = RoutingTableEntry();
+    entry.addr = htonl(addr);
+    entry.len = len;
+    // 文件中没有下一跳，按序号生成，保证查询结果各不相同
+    entry.if_index = seq % N_IFACE;
+    entry.nexthop = htonl(0x0a000000 | (seq % 251 + 1) << 8 | (seq % N_IFACE + 1));
+    entry.metric = htonl(1);
+    return entry;
+}
+
+static bool load_prefixes(const char *path, std::vector<RoutingTableEntry> &entries) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) return false;
+    std::string text;
+    char buffer[65536];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0) text.append(buffer, n);
+    fclose(fp);
+
+    uint32_t a, b, c, d, len;
+    if (text.compare(0, 1, "{") == 0) {
+        static const char key[] = "\"prefix\":\"";
+        for (size_t pos = text.find(key); pos != std::string::npos; pos = text.find(key, pos + 1)) {
+            if (sscanf(text.c_str() + pos + strlen(key), "%u.%u.%u.%u\\/%u", &a, &b, &c, &d, &len) == 5 && len <= 32) {
+                entries.push_back(make_entry(a, b, c, d, len, entries.size()));
+            }
+        }
+    } else {
+        size_t pos = 0;
+        while (pos < text.size()) {
+            if (sscanf(text.c_str() + pos, "route %u.%u.%u.%u/%u", &a, &b, &c, &d, &len) == 5 && len <= 32) {
+                entries.push_back(make_entry(a, b, c, d, len, entries.size()));
+            }
+            pos = text.find('\n', pos);
+            if (pos == std::string::npos) break;
+            pos++;
+        }
+    }
+    return true;
+}
+
+// 约六成 /24 ，其余散布在 /8 到 /32
+static std::vector<RoutingTableEntry> random_prefixes(size_t n) {
+    std::mt19937 rng(2020);
+    std::vector<RoutingTableEntry> entries;
+    entries.reserve(n);
+    while (entries.size() < n) {
+        uint32_t r = rng() % 100, addr = rng();
+        uint32_t len = r < 60 ? 24 : r < 80 ? 16 + rng() % 8 : r < 95 ? 8 + rng() % 8 : 25 + rng() % 8;
+        entries.push_back(make_entry(addr >> 24, addr >> 16 & 0xff, addr >> 8 & 0xff, addr & 0xff, len, entries.size()));
+    }
+    return entries;
+}
+
+// 均匀随机的目的地址，大多数不命中
+static std::vector<uint32_t> uniform_trace(size_t n, std::mt19937 &rng) {
+    std::vector<uint32_t> trace(n);
+    for (auto &addr: trace) addr = rng();
+    return trace;
+}
+
+// 表中前缀内的随机地址，每次查询都会命中
+static uint32_t host_in(const RoutingTableEntry &entry, std::mt19937 &rng) {
+    uint32_t host = entry.len < 32 ? rng() & (0xffffffffu >> entry.len) : 0;
+    return entry.addr | htonl(host);
+}
+
+static std::vector<uint32_t> covering_trace(size_t n, const std::vector<RoutingTableEntry> &entries, std::mt19937 &rng) {
+    std::vector<uint32_t> trace(n);
+    for (auto &addr: trace) addr = host_in(entries[rng() % entries.size()], rng);
+    return trace;
+}
+
+// 前缀按 Zipf(1) 分布被访问，模拟集中在少数目的网络的流量
+static std::vector<uint32_t> zipf_trace(size_t n, const std::vector<RoutingTableEntry> &entries, std::mt19937 &rng) {
+    std::vector<double> cdf(entries.size());
+    double sum = 0;
+    for (size_t i = 0; i < entries.size(); i++) cdf[i] = sum += 1.0 / (i + 1);
+    std::vector<size_t> rank(entries.size());
+    for (size_t i = 0; i < rank.size(); i++) rank[i] = i;
+    std::shuffle(rank.begin(), rank.end(), rng);
+    std::uniform_real_distribution<double> dist(0, sum);
+    std::vector<uint32_t> trace(n);
+    for (auto &addr: trace) {
+        size_t i = std::lower_bound(cdf.begin(), cdf.end(), dist(rng)) - cdf.begin();
+        addr = host_in(entries[rank[std::min(i, rank.size() - 1)]], rng);
+    }
+    return trace;
+}
+
+// batch 为 true 时每批地址一次交给 query_batch
+static void run_trace(const char *name, const std::vector<uint32_t> &trace, bool batch) {
+    std::vector<double> batch_ns;
+    batch_ns.reserve(trace.size() / BATCH + 1);
+    uint32_t checksum = 0, found = 0;
+    uint32_t nexthop[BATCH], if_index[BATCH];
+    bool hit[BATCH];
+    static int tlb = open_tlb_counter();
+    uint64_t tlb_begin = read_counter(tlb);
+    auto begin = clock_type::now();
+    for (size_t i = 0; i < trace.size(); i += BATCH) {
+        size_t end = std::min(trace.size(), i + BATCH);
+        auto t0 = clock_type::now();
+        if (batch) {
+            query_batch(&trace[i], end - i, nexthop, if_index, hit);
+            for (size_t j = 0; j < end - i; j++) {
+                if (hit[j]) {
+                    checksum += nexthop[j] + if_index[j];
+                    found++;
+                }
+            }
+        } else {
+            for (size_t j = i; j < end; j++) {
+                if (query(trace[j], &nexthop[0], &if_index[0])) {
+                    checksum += nexthop[0] + if_index[0];
+                    found++;
+                }
+            }
+        }
+        batch_ns.push_back(elapsed_ns(t0, clock_type::now()) / (end - i));
+    }
+    double total = elapsed_ns(begin, clock_type::now());
+    uint64_t tlb_misses = read_counter(tlb) - tlb_begin;
+    std::sort(batch_ns.begin(), batch_ns.end());
+    auto pct = [&] (double p) { return batch_ns[std::min(batch_ns.size() - 1, size_t(p * batch_ns.size()))]; };
+    char tlb_text[32] = "n/a";
+    if (tlb >= 0) snprintf(tlb_text, sizeof(tlb_text), "%.3f", double(tlb_misses) / trace.size());
+    printf("  %-9s %-6s %8.2f Mlookup/s  p50 %6.1f  p90 %6.1f  p99 %6.1f  max %7.1f ns  hit %5.1f%%  dTLB miss/lookup %s  (%08x)\n",
+           name, batch ? "batch" : "single", trace.size() / total * 1e3, pct(0.5), pct(0.9), pct(0.99), batch_ns.back(),
+           100.0 * found / trace.size(), tlb_text, checksum);
+}
+
+// 按 trace 逐个查询，结果（没有命中时为 0）写到 out
+static void query_trace(const std::vector<uint32_t> &trace, std::vector<uint64_t> &out) {
+    out.resize(trace.size());
+    for (size_t i = 0; i < trace.size(); i++) {
+        uint32_t nexthop, if_index;
+        out[i] = query(trace[i], &nexthop, &if_index) ? uint64_t(nexthop) << 32 | (if_index + 1) : 0;
+    }
+}
+
+/**
+ * 载入快照后像路由器的定期更新那样读一遍路由表（条数、游标遍历、分块、全部表项、精确查找），
+ * 检查这些只读操作之后转发仍直接查映射的快照，结果和保存前相同；
+ * 第一次修改后才转成路由表，结果仍然相同。
+ */
+static void check_snapshot(const std::vector<RoutingTableEntry> &entries, const std::vector<uint32_t> &trace) {
+    build(entries.data(), entries.size());
+    std::vector<uint64_t> expected, actual;
+    query_trace(trace, expected);
+    char path[] = "/tmp/bench-fib-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) return;
+    close(fd);
+    auto t0 = clock_type::now();
+    bool ok = save_snapshot(path) && load_snapshot(path);
+    double load_ns = elapsed_ns(t0, clock_type::now());
+    unlink(path);
+
+    size_t count = get_entry_count(), walked = 0, chunked = 0;
+    RoutingTableEntry chunk[25];
+    uint32_t cursor = 0;
+    while (size_t n = next_entries(&cursor, chunk, 25)) walked += n;
+    for (size_t k = 0; k < get_chunk_count(); k++) chunked += get_chunk_entries(k, chunk);
+    auto all = get_all_entries();
+    for (auto &entry: all) {
+        RoutingTableEntry found;
+        uint32_t mask = entry.len ? htonl(0xffffffffu << (32 - entry.len)) : 0;
+        ok = ok && query(entry.addr, mask, found) && found.nexthop == entry.nexthop && found.if_index == entry.if_index;
+    }
+    ok = ok && walked == count && chunked == count && all.size() == count;
+    bool mapped = is_snapshot_mapped();
+    query_trace(trace, actual);
+    bool same = actual == expected;
+
+    // 重新插入一条已有的表项，转发结果不变
+    if (!all.empty()) update(true, all[0]);
+    bool materialized = !is_snapshot_mapped();
+    query_trace(trace, actual);
+    bool same_after = actual == expected;
+
+    ok = ok && mapped && same && materialized && same_after;
+    if (!ok) failed = true;
+    printf("  snapshot: save+load %.2f ms, %zu entries, mapped after reads: %s, after first write: %s, lookups %s/%s: %s\n",
+           load_ns / 1e6, count, mapped ? "yes" : "no", materialized ? "no" : "yes",
+           same ? "same" : "differ", same_after ? "same" : "differ", ok ? "ok" : "FAILED");
+}
+
+static void run_engine(const char *engine, const std::vector<RoutingTableEntry> &entries, size_t n_queries) {
+    build(nullptr, 0);
+    select_engine(engine);
+
+    std::mt19937 rng(2019);
+    const char *names[] = {"uniform", "zipf", "covering"};
+    std::vector<uint32_t> traces[] = {
+        uniform_trace(n_queries, rng),
+        zipf_trace(n_queries, entries, rng),
+        covering_trace(n_queries, entries, rng),
+    };
+
+    // 逐条插入和删除的速率，表从空开始，各作为一批提交（和路由器处理一个 RIP 响应相同），
+    // 计入提交时引擎的整理；插入完和 build 之后的查询结果应当相同
+    // （输入中重复的前缀两种方式都以最后一条为准）
+    std::vector<uint64_t> inserted[2], built[2];
+    std::vector<RoutingTableEntry> changed;
+    auto t0 = clock_type::now();
+    batch_begin();
+    for (auto &entry: entries) update(true, entry);
+    batch_commit(changed);
+    double insert_ns = elapsed_ns(t0, clock_type::now());
+    size_t inserted_count = get_entry_count();
+    query_trace(traces[0], inserted[0]);
+    query_trace(traces[2], inserted[1]);
+    changed.clear();
+    t0 = clock_type::now();
+    batch_begin();
+    for (auto &entry: entries) update(false, entry);
+    batch_commit(changed);
+    double delete_ns = elapsed_ns(t0, clock_type::now());
+    t0 = clock_type::now();
+    build(entries.data(), entries.size());
+    double build_ns = elapsed_ns(t0, clock_type::now());
+    query_trace(traces[0], built[0]);
+    query_trace(traces[2], built[1]);
+    bool same = get_entry_count() == inserted_count && built[0] == inserted[0] && built[1] == inserted[1];
+    if (!same) failed = true;
+
+    size_t hugetlb, thp, small;
+    huge_stats(&hugetlb, &thp, &small);
+    printf("  %s: insert %.2f M/s, delete %.2f M/s, build %.2f ms (%s update), %.1f bytes/prefix, pages: hugetlb %zu MB, thp %zu MB, 4k %zu MB\n",
+           engine, entries.size() / insert_ns * 1e3, entries.size() / delete_ns * 1e3, build_ns / 1e6,
+           same ? "same as" : "FAILED: differs from", double(get_memory_usage()) / entries.size(), hugetlb >> 20, thp >> 20, small >> 20);
+
+    for (int i = 0; i < 3; i++) {
+        run_trace(names[i], traces[i], false);
+        run_trace(names[i], traces[i], true);
+    }
+    check_snapshot(entries, traces[2]);
+}
+
+/**
+ * duck.cpp 的 query_all 和逐个 query 回答同样的地址，结果应当相同。
+ * 它的 init 只能调用一次，所以只检查第一组前缀。
+ */
+static void check_duck(const std::vector<RoutingTableEntry> &entries, size_t n_queries) {
+    static bool done = false;
+    if (done) return;
+    done = true;
+    std::mt19937 rng(2021);
+    auto trace = uniform_trace(n_queries, rng);
+    auto covering = covering_trace(n_queries, entries, rng);
+    trace.insert(trace.end(), covering.begin(), covering.end());
+    init(entries.size(), trace.size(), entries.data());
+
+    std::vector<unsigned> single(trace.size()), batch(trace.size());
+    auto t0 = clock_type::now();
+    for (size_t i = 0; i < trace.size(); i++) single[i] = query(trace[i]);
+    double single_ns = elapsed_ns(t0, clock_type::now());
+    t0 = clock_type::now();
+    query_all(trace.size(), trace.data(), batch.data());
+    double batch_ns = elapsed_ns(t0, clock_type::now());
+    bool same = single == batch;
+    if (!same) failed = true;
+    printf("  duck: query %.2f Mlookup/s, query_all %.2f Mlookup/s (including build), results %s\n",
+           trace.size() / single_ns * 1e3, trace.size() / batch_ns * 1e3, same ? "same" : "FAILED: differ");
+}
+
+static void run_prefixes(const char *name, const std::vector<RoutingTableEntry> &entries, const std::vector<const char *> &engines,
+                         const std::vector<bool> &huge, size_t n_queries) {
+    std::map<uint32_t, size_t> lens;
+    for (auto &entry: entries) lens[entry.len]++;
+    printf("%s: %zu prefixes, %zu distinct lengths\n", name, entries.size(), lens.size());
+    check_duck(entries, n_queries);
+    for (auto engine: engines) {
+        for (bool enable: huge) {
+            // 已经分配的表要清空后重新分配才会换页
+            build(nullptr, 0);
+            set_huge_pages(enable);
+            if (huge.size() > 1) printf("  [%s pages]\n", enable ? "huge" : "4k");
+            run_engine(engine, entries, n_queries);
+        }
+    }
+}
+
+static void run_file(const char *path, const std::vector<const char *> &engines, const std::vector<bool> &huge, size_t n_queries) {
+    std::vector<RoutingTableEntry> entries;
+    if (!load_prefixes(path, entries) || entries.empty()) {
+        printf("%s: no prefixes loaded\n", path);
+        return;
+    }
+    run_prefixes(path, entries, engines, huge, n_queries);
+}
+
+int main(int argc, char *argv[]) {
+    size_t n_queries = 1 << 22;
+    std::vector<const char *> files, engines;
+    std::vector<size_t> random_counts;
+    std::vector<bool> huge(1, true);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            n_queries = strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+            engines.push_back(argv[++i]);
+            if (!select_engine(engines.back())) {
+                fprintf(stderr, "unknown engine %s\n", engines.back());
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            random_counts.push_back(strtoul(argv[++i], nullptr, 10));
+        } else if (strcmp(argv[i], "-H") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "on") == 0) huge.assign(1, true);
+            else if (strcmp(argv[i], "off") == 0) huge.assign(1, false);
+            else if (strcmp(argv[i], "both") == 0) huge = {false, true};
+            else {
+                fprintf(stderr, "-H expects on, off or both\n");
+                return 1;
+            }
+        } else {
+            files.push_back(argv[i]);
+        }
+    }
+    if (files.empty() && random_counts.empty()) files.assign(default_files, default_files + sizeof(default_files) / sizeof(*default_files));
+    if (engines.empty()) {
+        for (size_t i = 0; get_engine_name(i); i++) engines.push_back(get_engine_name(i));
+    }
+    if (n_queries < BATCH) n_queries = BATCH;
+    for (auto path: files) run_file(path, engines, huge, n_queries);
+    for (auto count: random_counts) {
+        char name[32];
+        snprintf(name, sizeof(name), "random %zu", count);
+        run_prefixes(name, random_prefixes(count), engines, huge, n_queries);
+    }
+    return failed ? 1 : 0;
+}
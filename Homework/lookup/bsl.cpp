@@ -0,0 +1,233 @@
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <unordered_map>
+#include <arpa/inet.h>
+
+#include "router.h"
+#include "fib.h"
+
+/*
+  按前缀长度二分查找（Waldvogel et al., Scalable High Speed IP Routing Lookups）：
+    表中出现的每种长度一张哈希表，对这些长度做二分：
+    在某个长度命中就去更长的一半，否则去更短的一半。
+  为了让二分在命中时往更长处走是对的，在每条前缀的二分路径上更短的长度处放 marker ，
+  每个表项（前缀或 marker）预先算好它的最佳匹配前缀（bmp），查询不需要回溯。
+  每种长度还可以带一个 Bloom filter ，不命中时大多不用访问哈希表。
+
+  修改只记在每种长度的规则表中，marker 和 bmp 在 commit 时统一重建，查询路径上不重建，
+  commit 之前的查询用的还是上一次重建的结果。重建的代价和整个表的大小成正比（十万条前缀
+  约 40 毫秒），路由器中每个 RIP 响应、每批超时各一次，适合前缀长度种类少、变化不频繁的表。
+*/
+struct BslTable : FibEngine {
+    struct slot_t {
+        uint32_t key;
+        uint32_t bmp;       // 最佳匹配前缀的下一跳编号，0 表示没有
+        bool used;
+    };
+    // 一种长度的哈希表，线性探测
+    struct level_t {
+        uint32_t len;
+        uint32_t mask;
+        std::vector<slot_t> slots;
+        std::vector<uint64_t> bloom;
+        int shift;
+
+        // 前缀的低位都是 0 ，要取乘积的高位
+        size_t home(uint32_t key) const { return (key * 0x9e3779b1u) >> shift; }
+
+        void init(size_t n, bool with_bloom) {
+            size_t size = 4;
+            shift = 30;
+            while (size < n * 2) size *= 2, shift--;
+            slots.assign(size, slot_t{0, 0, false});
+            bloom.assign(with_bloom ? (size + 63) / 64 * 2 : 0, 0);
+        }
+
+        // 两个哈希位取自同一个乘法哈希的高低两半，每项约 4~8 位
+        bool maybe(uint32_t key) const {
+            if (bloom.empty()) return true;
+            uint64_t h = uint64_t(key) * 0x9e3779b97f4a7c15ull;
+            size_t bits = bloom.size() * 64;
+            size_t a = (h >> 32) % bits, b = (h & 0xffffffff) % bits;
+            return (bloom[a / 64] >> (a % 64) & 1) && (bloom[b / 64] >> (b % 64) & 1);
+        }
+
+        slot_t &slot(uint32_t key) {
+            size_t i = home(key);
+            while (slots[i].used && slots[i].key != key) i = (i + 1) & (slots.size() - 1);
+            return slots[i];
+        }
+
+        const slot_t *find(uint32_t key) const {
+            size_t i = home(key);
+            for (; slots[i].used; i = (i + 1) & (slots.size() - 1)) {
+                if (slots[i].key == key) return &slots[i];
+            }
+            return nullptr;
+        }
+
+        void add(uint32_t key, uint32_t bmp) {
+            auto &s = slot(key);
+            if (!s.used && !bloom.empty()) {
+                uint64_t h = uint64_t(key) * 0x9e3779b97f4a7c15ull;
+                size_t bits = bloom.size() * 64;
+                size_t a = (h >> 32) % bits, b = (h & 0xffffffff) % bits;
+                bloom[a / 64] |= 1ull << (a % 64);
+                bloom[b / 64] |= 1ull << (b % 64);
+            }
+            s = slot_t{key, bmp, true};
+        }
+    };
+
+    // 每种长度的规则：前缀（小端序，只保留前 len 位）-> (nexthop, if_index)
+    std::unordered_map<uint32_t, std::pair<uint32_t, uint32_t>> rules[33];
+    bool use_bloom = true;
+
+    // 以下在 rebuild 中生成
+    bool dirty = false;     // 规则表有修改，还没有 commit
+    std::vector<level_t> levels;            // 按长度从小到大
+    std::vector<uint32_t> nh_addr, nh_if;   // 下标 0 不使用
+
+    BslTable() { clear(); }
+
+    const char *name() const override { return "bsl"; }
+
+    static uint32_t mask(uint32_t len) { return len ? ~0u << (32 - len) : 0; }
+
+    void clear() override {
+        for (auto &r: rules) r.clear();
+        dirty = true;
+    }
+
+    void insert(const RoutingTableEntry &entry) override {
+        rules[entry.len][ntohl(entry.addr) & mask(entry.len)] = std::make_pair(entry.nexthop, entry.if_index);
+        dirty = true;
+    }
+
+    void remove(const RoutingTableEntry &entry) override {
+        if (rules[entry.len].erase(ntohl(entry.addr) & mask(entry.len))) dirty = true;
+    }
+
+    // 长度不超过 levels[i] 的最长的覆盖 key 的规则
+    uint32_t best_rule(uint32_t key, int i, std::unordered_map<uint64_t, uint32_t> &ids) {
+        for (; i >= 0; i--) {
+            auto len = levels[i].len;
+            auto it = rules[len].find(key & mask(len));
+            if (it == rules[len].end()) continue;
+            auto &id = ids[uint64_t(it->second.first) << 32 | it->second.second];
+            if (!id) {
+                id = nh_addr.size();
+                nh_addr.push_back(it->second.first);
+                nh_if.push_back(it->second.second);
+            }
+            return id;
+        }
+        return 0;
+    }
+
+    void rebuild() {
+        dirty = false;
+        levels.clear();
+        nh_addr.assign(1, 0);
+        nh_if.assign(1, 0);
+        // 每层的表项数：前缀数加上 marker 数
+        std::vector<size_t> count;
+        for (uint32_t len = 0; len <= 32; len++) {
+            if (rules[len].empty()) continue;
+            levels.push_back(level_t{len, mask(len), {}, {}, 0});
+            count.push_back(rules[len].size());
+        }
+        int k = levels.size();
+        // 对第 j 层的前缀，二分路径上比它短的层放 marker
+        auto for_path = [&] (int j, uint32_t key, std::vector<std::pair<int, uint32_t>> *out) {
+            int lo = 0, hi = k - 1;
+            while (lo <= hi) {
+                int mid = (lo + hi) / 2;
+                if (mid == j) break;
+                if (mid < j) {
+                    if (out) out->push_back(std::make_pair(mid, key & levels[mid].mask));
+                    else count[mid]++;
+                    lo = mid + 1;
+                } else {
+                    hi = mid - 1;
+                }
+            }
+        };
+        for (int j = 0; j < k; j++) {
+            for (auto &r: rules[levels[j].len]) for_path(j, r.first, nullptr);
+        }
+        for (int j = 0; j < k; j++) levels[j].init(count[j], use_bloom);
+
+        std::unordered_map<uint64_t, uint32_t> ids;
+        std::vector<std::pair<int, uint32_t>> markers;
+        for (int j = 0; j < k; j++) {
+            for (auto &r: rules[levels[j].len]) {
+                levels[j].add(r.first, best_rule(r.first, j, ids));
+                markers.clear();
+                for_path(j, r.first, &markers);
+                for (auto &m: markers) {
+                    // 已经有同样前缀的表项（前缀或 marker）时不用重复计算
+                    if (levels[m.first].find(m.second)) continue;
+                    levels[m.first].add(m.second, best_rule(m.second, m.first, ids));
+                }
+            }
+        }
+    }
+
+    void commit() override {
+        if (dirty) rebuild();
+    }
+
+    // 返回下一跳编号，0 表示没有匹配
+    uint32_t find_id(uint32_t addr) const {
+        addr = ntohl(addr);
+        uint32_t best = 0;
+        int lo = 0, hi = int(levels.size()) - 1;
+        while (lo <= hi) {
+            int mid = (lo + hi) / 2;
+            auto &level = levels[mid];
+            uint32_t key = addr & level.mask;
+            const slot_t *s = level.maybe(key) ? level.find(key) : nullptr;
+            if (s) {
+                best = s->bmp;
+                lo = mid + 1;
+            } else {
+                hi = mid - 1;
+            }
+        }
+        return best;
+    }
+
+    bool lookup(uint32_t addr, uint32_t *nexthop, uint32_t *if_index) override {
+        auto id = find_id(addr);
+        if (!id) return false;
+        *nexthop = nh_addr[id];
+        *if_index = nh_if[id];
+        return true;
+    }
+
+    void iterate(const std::function<void(const RoutingTableEntry &)> &visit) const override {
+        for (uint32_t len = 0; len <= 32; len++) {
+            for (auto &r: rules[len]) {
+                RoutingTableEntry entry = RoutingTableEntry();
+                entry.addr = htonl(r.first);
+                entry.len = len;
+                entry.nexthop = r.second.first;
+                entry.if_index = r.second.second;
+                visit(entry);
+            }
+        }
+    }
+
+    size_t memory_usage() const override {
+        size_t size = (nh_addr.capacity() + nh_if.capacity()) * sizeof(uint32_t);
+        for (auto &level: levels) size += level.slots.capacity() * sizeof(slot_t) + level.bloom.capacity() * sizeof(uint64_t);
+        for (auto &r: rules) size += r.size() * (sizeof(uint32_t) * 3 + 2 * sizeof(void *));
+        return size;
+    }
+};
+
+FibEngine *new_bsl_engine() {
+    return new BslTable;
+}
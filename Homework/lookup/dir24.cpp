@@ -0,0 +1,281 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <arpa/inet.h>
+
+#include "router.h"
+#include "fib.h"
+#include "hugepage.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DIR24_HAVE_AVX2
+#endif
+
+/*
+  DIR-24-8 平坦查找表：
+    tbl24[addr >> 8] 直接给出长度不超过 24 的前缀的结果；
+    若有更长的前缀，tbl24 中存一个 tbl8 组号，再用 addr & 0xff 在 256 项的组中查。
+  每一项 32 位：
+    最高位为 1 时低 24 位是 tbl8 组号（只出现在 tbl24 中）；
+    否则第 24~29 位是命中前缀的长度，低 24 位是下一跳编号，编号 0 表示没有路由。
+  每个下一跳 (nexthop, if_index) 只存一份，查出编号后再取下一跳，方便一次 gather 。
+*/
+struct Dir24Table : FibEngine {
+    static constexpr uint32_t EXT = 0x80000000u;
+    static constexpr uint32_t ID_MASK = 0x00ffffffu;
+
+    uint32_t *tbl24 = nullptr;              // 1 << 24 项（64MB），第一次插入时从大页分配
+    huge_vector<uint32_t> tbl8;
+    std::vector<uint32_t> free_groups;
+    // 下一跳表，下标 0 不使用
+    std::vector<uint32_t> nh_addr, nh_if, nh_ref;
+    std::vector<uint32_t> free_nh;
+    std::unordered_map<uint64_t, uint32_t> nh_id;
+    // 每种长度的前缀（小端序，只保留前 len 位）-> 下一跳编号，删除时用来找上一级前缀
+    std::unordered_map<uint32_t, uint32_t> rules[33];
+
+    Dir24Table() { clear(); }
+    ~Dir24Table() { huge_free(tbl24); }
+
+    const char *name() const override { return "dir24"; }
+
+    static uint32_t make(uint32_t len, uint32_t id) { return len << 24 | id; }
+    static uint32_t depth(uint32_t e) { return e >> 24 & 0x3f; }
+    static uint32_t mask(uint32_t len) { return len ? ~0u << (32 - len) : 0; }
+
+    void clear() override {
+        huge_free(tbl24);
+        tbl24 = nullptr;
+        huge_vector<uint32_t>().swap(tbl8);
+        free_groups.clear();
+        nh_addr.assign(1, 0);
+        nh_if.assign(1, 0);
+        nh_ref.assign(1, 0);
+        free_nh.clear();
+        nh_id.clear();
+        for (auto &r: rules) r.clear();
+    }
+
+    uint32_t acquire_nh(uint32_t nexthop, uint32_t if_index) {
+        auto &id = nh_id[uint64_t(nexthop) << 32 | if_index];
+        if (!id) {
+            if (!free_nh.empty()) {
+                id = free_nh.back();
+                free_nh.pop_back();
+            } else {
+                id = nh_addr.size();
+                nh_addr.push_back(0);
+                nh_if.push_back(0);
+                nh_ref.push_back(0);
+            }
+            nh_addr[id] = nexthop;
+            nh_if[id] = if_index;
+        }
+        nh_ref[id]++;
+        return id;
+    }
+
+    void release_nh(uint32_t id) {
+        if (--nh_ref[id]) return;
+        nh_id.erase(uint64_t(nh_addr[id]) << 32 | nh_if[id]);
+        free_nh.push_back(id);
+    }
+
+    uint32_t new_group(uint32_t fill) {
+        uint32_t g;
+        if (!free_groups.empty()) {
+            g = free_groups.back();
+            free_groups.pop_back();
+        } else {
+            g = tbl8.size() >> 8;
+            tbl8.resize(tbl8.size() + 256);
+        }
+        std::fill(tbl8.begin() + (g << 8), tbl8.begin() + (g << 8) + 256, fill);
+        return g;
+    }
+
+    // 把 [begin, end) 中长度满足 replace(depth) 的项改为 value
+    template <typename F>
+    void fill24(uint32_t begin, uint32_t end, uint32_t value, F replace) {
+        for (uint32_t i = begin; i < end; i++) {
+            auto e = tbl24[i];
+            if (e & EXT) {
+                auto group = &tbl8[(e & ID_MASK) << 8];
+                for (int j = 0; j < 256; j++) {
+                    if (replace(depth(group[j]))) group[j] = value;
+                }
+            } else if (replace(depth(e))) {
+                tbl24[i] = value;
+            }
+        }
+    }
+
+    // 删掉一条更长的前缀后，组内可能全部相同，合并回 tbl24
+    void try_collapse(uint32_t i) {
+        auto g = tbl24[i] & ID_MASK;
+        auto group = &tbl8[g << 8];
+        for (int j = 1; j < 256; j++) {
+            if (group[j] != group[0]) return;
+        }
+        tbl24[i] = group[0];
+        free_groups.push_back(g);
+    }
+
+    void apply(uint32_t addr, uint32_t len, uint32_t value, bool removing) {
+        // 插入时覆盖不比它长的前缀的结果，删除时只恢复原来属于它的项
+        auto replace = [=] (uint32_t d) { return removing ? d == len : d <= len; };
+        if (len <= 24) {
+            fill24(addr >> 8, (addr >> 8) + (1u << (24 - len)), value, replace);
+            return;
+        }
+        auto i = addr >> 8;
+        if (!(tbl24[i] & EXT)) {
+            if (removing) return;
+            tbl24[i] = EXT | new_group(tbl24[i]);
+        }
+        auto group = &tbl8[(tbl24[i] & ID_MASK) << 8];
+        for (uint32_t j = addr & 0xff; j < (addr & 0xff) + (1u << (32 - len)); j++) {
+            if (replace(depth(group[j]))) group[j] = value;
+        }
+        if (removing) try_collapse(i);
+    }
+
+    void insert(const RoutingTableEntry &entry) override {
+        if (!tbl24) {
+            // 和其它引擎的 huge_vector 一样，分配失败时抛出 bad_alloc ，表保持为空
+            tbl24 = (uint32_t *)huge_alloc(sizeof(uint32_t) << 24);
+            if (!tbl24) throw std::bad_alloc();
+        }
+        auto len = entry.len;
+        auto addr = ntohl(entry.addr) & mask(len);
+        auto id = acquire_nh(entry.nexthop, entry.if_index);
+        auto it = rules[len].find(addr);
+        if (it != rules[len].end()) {
+            release_nh(it->second);
+            it->second = id;
+        } else {
+            rules[len][addr] = id;
+        }
+        apply(addr, len, make(len, id), false);
+    }
+
+    void remove(const RoutingTableEntry &entry) override {
+        auto len = entry.len;
+        auto addr = ntohl(entry.addr) & mask(len);
+        auto it = rules[len].find(addr);
+        if (it == rules[len].end()) return;
+        release_nh(it->second);
+        rules[len].erase(it);
+        // 由覆盖它的最长前缀接管，没有则变为无路由
+        uint32_t value = 0;
+        for (int l = int(len) - 1; l >= 0; l--) {
+            auto parent = rules[l].find(addr & mask(l));
+            if (parent != rules[l].end()) {
+                value = make(l, parent->second);
+                break;
+            }
+        }
+        apply(addr, len, value, true);
+    }
+
+    // 小端序的地址，返回下一跳编号
+    uint32_t find_id(uint32_t addr) const {
+        auto e = tbl24[addr >> 8];
+        if (e & EXT) e = tbl8[(e & ID_MASK) << 8 | (addr & 0xff)];
+        return e & ID_MASK;
+    }
+
+    void lookup_scalar(const uint32_t *addr, int n, uint32_t *nexthop, uint32_t *if_index, bool *found) const {
+        for (int i = 0; i < n; i++) {
+            auto id = find_id(ntohl(addr[i]));
+            found[i] = id != 0;
+            nexthop[i] = nh_addr[id];
+            if_index[i] = nh_if[id];
+        }
+    }
+
+#ifdef DIR24_HAVE_AVX2
+    // 一次处理 8 个地址：gather tbl24 ，有 tbl8 的通道逐个标量处理，再 gather 下一跳
+    __attribute__((target("avx2")))
+    void lookup_avx2(const uint32_t *addr, int n, uint32_t *nexthop, uint32_t *if_index, bool *found) const {
+        const __m256i bswap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                               3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+        const __m256i id_mask = _mm256_set1_epi32(ID_MASK);
+        const __m256i zero = _mm256_setzero_si256();
+        int i = 0;
+        for (; i + 8 <= n; i += 8) {
+            auto a = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(addr + i)), bswap);
+            auto e = _mm256_i32gather_epi32((const int *)tbl24, _mm256_srli_epi32(a, 8), 4);
+            int ext = _mm256_movemask_ps(_mm256_castsi256_ps(e));
+            if (ext) {
+                alignas(32) uint32_t lanes[8], hosts[8];
+                _mm256_store_si256((__m256i *)lanes, e);
+                _mm256_store_si256((__m256i *)hosts, a);
+                for (int j = 0; j < 8; j++) {
+                    if (ext >> j & 1) lanes[j] = tbl8[(lanes[j] & ID_MASK) << 8 | (hosts[j] & 0xff)];
+                }
+                e = _mm256_load_si256((const __m256i *)lanes);
+            }
+            auto id = _mm256_and_si256(e, id_mask);
+            _mm256_storeu_si256((__m256i *)(nexthop + i), _mm256_i32gather_epi32((const int *)nh_addr.data(), id, 4));
+            _mm256_storeu_si256((__m256i *)(if_index + i), _mm256_i32gather_epi32((const int *)nh_if.data(), id, 4));
+            int miss = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(id, zero)));
+            for (int j = 0; j < 8; j++) found[i + j] = !(miss >> j & 1);
+        }
+        lookup_scalar(addr + i, n - i, nexthop + i, if_index + i, found + i);
+    }
+#endif
+
+    bool lookup(uint32_t addr, uint32_t *nexthop, uint32_t *if_index) override {
+        if (!tbl24) return false;
+        auto id = find_id(ntohl(addr));
+        if (!id) return false;
+        *nexthop = nh_addr[id];
+        *if_index = nh_if[id];
+        return true;
+    }
+
+    // 只有 bench 的批量测试会走到这里，见 fib.h
+    void lookup_batch(const uint32_t *addr, int n, uint32_t *nexthop, uint32_t *if_index, bool *found) override {
+        if (!tbl24) {
+            memset(found, 0, n * sizeof(bool));
+            return;
+        }
+#ifdef DIR24_HAVE_AVX2
+        static const bool has_avx2 = __builtin_cpu_supports("avx2");
+        if (has_avx2) {
+            lookup_avx2(addr, n, nexthop, if_index, found);
+            return;
+        }
+#endif
+        lookup_scalar(addr, n, nexthop, if_index, found);
+    }
+
+    void iterate(const std::function<void(const RoutingTableEntry &)> &visit) const override {
+        for (uint32_t len = 0; len <= 32; len++) {
+            for (auto &r: rules[len]) {
+                RoutingTableEntry entry = RoutingTableEntry();
+                entry.addr = htonl(r.first);
+                entry.len = len;
+                entry.if_index = nh_if[r.second];
+                entry.nexthop = nh_addr[r.second];
+                visit(entry);
+            }
+        }
+    }
+
+    size_t memory_usage() const override {
+        size_t size = (tbl24 ? sizeof(uint32_t) << 24 : 0) + tbl8.capacity() * sizeof(uint32_t) +
+                      nh_addr.capacity() * 3 * sizeof(uint32_t);
+        for (auto &r: rules) size += r.size() * (sizeof(std::pair<uint32_t, uint32_t>) + 2 * sizeof(void *));
+        return size;
+    }
+};
+
+FibEngine *new_dir24_engine() {
+    return new Dir24Table;
+}
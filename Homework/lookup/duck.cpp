@@ -2,6 +2,9 @@
 #include <cstdlib>
 #include <iostream>
 #include <utility>
+#include <vector>
+#include <algorithm>
+#include <thread>
 #include "router.h"
 
 static uint32_t rev_bytes(const uint32_t &val) {
@@ -50,8 +53,122 @@ struct RouterTable {
 };
 static RouterTable table;
 
+/*
+  离线批量查询：表不再变化、查询全部已知时，不必逐个走 trie 。
+  把前缀展开成互不相交的区间 [start, 下一段的 start) -> nexthop ，
+  查询排序后和区间表做一次归并扫描即可全部回答。
+  查询按原顺序分成若干段，每个线程排序并扫描自己的一段，互不干扰。
+*/
+struct IntervalTable {
+    struct segment_t {
+        uint32_t start;
+        unsigned nexthop;   // 0 表示没有路由
+    };
+    struct order_t {
+        uint32_t start;
+        uint32_t len;
+        uint32_t index;     // 在输入中的序号
+
+        bool operator<(const order_t &o) const {
+            if (start != o.start) return start < o.start;
+            if (len != o.len) return len < o.len;
+            return index < o.index;
+        }
+    };
+    std::vector<RoutingTableEntry> prefixes;
+    std::vector<segment_t> segments;    // 按 start 递增，第一段从 0 开始
+    bool built = false;
+
+    void build() {
+        built = true;
+        // 同一前缀保留最后一条，和 trie 的覆盖语义一致
+        std::vector<order_t> order(prefixes.size());
+        for (size_t i = 0; i < prefixes.size(); i++) {
+            auto len = prefixes[i].len;
+            uint32_t start = len ? rev_bytes(prefixes[i].addr) & ~0u << (32 - len) : 0;
+            order[i] = order_t{start, len, uint32_t(i)};
+        }
+        std::sort(order.begin(), order.end());
+
+        segments.assign(1, segment_t{0, 0});
+        auto emit = [&] (uint64_t pos, unsigned nexthop) {
+            if (pos >> 32) return;
+            if (segments.back().start == pos) {
+                segments.back().nexthop = nexthop;
+            } else if (segments.back().nexthop != nexthop) {
+                segments.push_back(segment_t{uint32_t(pos), nexthop});
+            }
+            // 同一位置被覆盖后可能和前一段相同
+            auto n = segments.size();
+            if (n >= 2 && segments[n - 2].nexthop == segments[n - 1].nexthop) segments.pop_back();
+        };
+        // 当前位置上嵌套的前缀，外层在下
+        std::vector<std::pair<uint64_t, unsigned>> open;    // (end, nexthop)
+        auto close_until = [&] (uint64_t pos) {
+            while (!open.empty() && open.back().first <= pos) {
+                auto end = open.back().first;
+                open.pop_back();
+                emit(end, open.empty() ? 0 : open.back().second);
+            }
+        };
+        for (size_t k = 0; k < order.size(); k++) {
+            if (k + 1 < order.size() && order[k].start == order[k + 1].start && order[k].len == order[k + 1].len) continue;
+            auto &p = prefixes[order[k].index];
+            uint64_t start = order[k].start;
+            close_until(start);
+            open.push_back(std::make_pair(start + (1ull << (32 - p.len)), p.nexthop));
+            emit(start, p.nexthop);
+        }
+        close_until(1ull << 32);
+    }
+
+    // 回答 addr[begin, end) ，key 为这一段的临时空间
+    void sweep(const unsigned *addr, unsigned *result, size_t begin, size_t end, std::vector<uint64_t> &key) const {
+        key.resize(end - begin);
+        for (size_t i = begin; i < end; i++) key[i - begin] = uint64_t(rev_bytes(addr[i])) << 32 | (i - begin);
+        std::sort(key.begin(), key.end());
+        if (key.empty()) return;
+        // 从包含最小地址的区间开始往后走
+        auto seg = std::upper_bound(segments.begin(), segments.end(), uint32_t(key[0] >> 32),
+                                    [] (uint32_t a, const segment_t &s) { return a < s.start; }) - 1;
+        for (auto k: key) {
+            uint32_t a = k >> 32;
+            while (seg + 1 != segments.end() && seg[1].start <= a) ++seg;
+            result[begin + uint32_t(k)] = seg->nexthop;
+        }
+    }
+
+    void query_all(int q, const unsigned *addr, unsigned *result) {
+        if (!built) build();
+        size_t threads = std::thread::hardware_concurrency();
+        // 查询少时开线程不划算
+        threads = std::max<size_t>(1, std::min<size_t>(threads, q / (1 << 16)));
+        std::vector<std::vector<uint64_t>> keys(threads);
+        std::vector<std::thread> workers;
+        for (size_t t = 1; t < threads; t++) {
+            workers.emplace_back([=, &keys] {
+                sweep(addr, result, q * t / threads, q * (t + 1) / threads, keys[t]);
+            });
+        }
+        sweep(addr, result, 0, q / threads, keys[0]);
+        for (auto &w: workers) w.join();
+    }
+};
+static IntervalTable intervals;
+
 void init(int n, int q, const RoutingTableEntry *a) {
 	for (int i = 0; i < n; i++) table.insert(a[i]);
+	intervals.prefixes.assign(a, a + n);
+	intervals.built = false;
+}
+
+/**
+ * @brief 一次回答全部 q 个查询，结果和逐个调用 query 相同
+ * @param addr 要查询的地址，和 query 的参数一样
+ * @param result 第 i 个地址的 nexthop ，没有路由时为 0
+ */
+void query_all(int q, const unsigned *addr, unsigned *result) {
+    intervals.query_all(q, addr, result);
 }
 
 unsigned query(unsigned addr) {
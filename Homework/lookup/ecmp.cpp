@@ -0,0 +1,189 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <arpa/inet.h>
+
+/*
+  等价多路径（ECMP）的下一跳组。
+  每组最多 MAX_PATHS 个成员 (nexthop, if_index) ，BUCKETS 个桶各指向一个成员，
+  报文按五元组哈希落到一个桶上，同一条流总是走同一条路径。
+  成员变化时只改动必须改的桶（resilient hashing）：
+    加入成员时从桶最多的成员那里拿走一部分桶；
+    删除成员时只把它的桶分给剩下桶最少的成员，其余流的路径不变。
+*/
+struct EcmpGroups {
+    static constexpr int MAX_PATHS = 8;
+    static constexpr int BUCKETS = 64;
+
+    struct group_t {
+        uint32_t n;                     // 成员数，0 表示空闲
+        uint32_t nexthop[MAX_PATHS];
+        uint32_t if_index[MAX_PATHS];
+        uint8_t bucket[BUCKETS];        // 桶 -> 成员下标
+    };
+    std::vector<group_t> groups;        // 下标 0 不使用
+    std::vector<uint32_t> free_groups;
+
+    EcmpGroups() { clear(); }
+
+    void clear() {
+        groups.assign(1, group_t());
+        free_groups.clear();
+    }
+
+    uint32_t alloc() {
+        uint32_t g;
+        if (!free_groups.empty()) {
+            g = free_groups.back();
+            free_groups.pop_back();
+        } else {
+            g = groups.size();
+            groups.push_back(group_t());
+        }
+        groups[g] = group_t();
+        return g;
+    }
+
+    void release(uint32_t g) {
+        groups[g].n = 0;
+        free_groups.push_back(g);
+    }
+
+    static int find(const group_t &group, uint32_t nexthop, uint32_t if_index) {
+        for (uint32_t i = 0; i < group.n; i++) {
+            if (group.nexthop[i] == nexthop && group.if_index[i] == if_index) return i;
+        }
+        return -1;
+    }
+
+    bool add(uint32_t g, uint32_t nexthop, uint32_t if_index) {
+        auto &group = groups[g];
+        if (group.n == MAX_PATHS || find(group, nexthop, if_index) >= 0) return false;
+        uint32_t m = group.n++;
+        group.nexthop[m] = nexthop;
+        group.if_index[m] = if_index;
+        if (m == 0) {
+            for (auto &b: group.bucket) b = 0;
+            return true;
+        }
+        int count[MAX_PATHS] = {};
+        for (auto b: group.bucket) count[b]++;
+        // 新成员拿到平均份额，每次从当前桶最多的成员那里拿一个
+        for (int need = BUCKETS / group.n; need > 0; need--) {
+            uint32_t richest = 0;
+            for (uint32_t i = 1; i < m; i++) {
+                if (count[i] > count[richest]) richest = i;
+            }
+            for (auto &b: group.bucket) {
+                if (b == richest) {
+                    b = m;
+                    break;
+                }
+            }
+            count[richest]--;
+        }
+        return true;
+    }
+
+    bool remove(uint32_t g, uint32_t nexthop, uint32_t if_index) {
+        auto &group = groups[g];
+        int m = find(group, nexthop, if_index);
+        if (m < 0) return false;
+        uint32_t last = --group.n;
+        if (!group.n) return true;
+        int count[MAX_PATHS] = {};
+        for (auto b: group.bucket) count[b]++;
+        // 只动原来属于 m 的桶，每次分给当前桶最少的成员
+        for (auto &b: group.bucket) {
+            if (b != m) continue;
+            uint32_t poorest = m ? 0 : 1;
+            for (uint32_t i = 0; i <= last; i++) {
+                if (int(i) != m && count[i] < count[poorest]) poorest = i;
+            }
+            b = poorest;
+            count[poorest]++;
+        }
+        // 最后一个成员搬到空出的位置
+        if (uint32_t(m) != last) {
+            group.nexthop[m] = group.nexthop[last];
+            group.if_index[m] = group.if_index[last];
+            for (auto &b: group.bucket) {
+                if (b == last) b = m;
+            }
+        }
+        return true;
+    }
+};
+static EcmpGroups ecmp;
+
+uint32_t ecmp_alloc() {
+    return ecmp.alloc();
+}
+
+void ecmp_release(uint32_t group) {
+    ecmp.release(group);
+}
+
+void ecmp_clear() {
+    ecmp.clear();
+}
+
+bool ecmp_add(uint32_t group, uint32_t nexthop, uint32_t if_index) {
+    return ecmp.add(group, nexthop, if_index);
+}
+
+bool ecmp_remove(uint32_t group, uint32_t nexthop, uint32_t if_index) {
+    return ecmp.remove(group, nexthop, if_index);
+}
+
+uint32_t ecmp_size(uint32_t group) {
+    return ecmp.groups[group].n;
+}
+
+void ecmp_member(uint32_t group, uint32_t i, uint32_t *nexthop, uint32_t *if_index) {
+    *nexthop = ecmp.groups[group].nexthop[i];
+    *if_index = ecmp.groups[group].if_index[i];
+}
+
+void ecmp_select(uint32_t group, uint32_t hash, uint32_t *nexthop, uint32_t *if_index) {
+    auto &g = ecmp.groups[group];
+    auto m = g.bucket[hash % EcmpGroups::BUCKETS];
+    *nexthop = g.nexthop[m];
+    *if_index = g.if_index[m];
+}
+
+size_t ecmp_memory_usage() {
+    return ecmp.groups.capacity() * sizeof(EcmpGroups::group_t) + ecmp.free_groups.capacity() * sizeof(uint32_t);
+}
+
+static uint32_t mix(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+// 只有目的地址时的哈希，同一目的地址总是走同一条路径
+uint32_t addr_hash(uint32_t addr) {
+    return mix(addr);
+}
+
+/**
+ * @brief 按五元组（源、目的地址，协议，TCP/UDP 的源、目的端口）计算流哈希
+ * @param packet 完整的 IP 报文，len 为其长度
+ *
+ * 分片（除第一片外没有端口）和其他协议只用前三项，同一条流的所有报文哈希相同。
+ */
+uint32_t flow_hash(const uint8_t *packet, size_t len) {
+    if (len < 20) return 0;
+    uint32_t src = *(const uint32_t *)(packet + 12);
+    uint32_t dst = *(const uint32_t *)(packet + 16);
+    uint8_t proto = packet[9];
+    size_t ihl = (packet[0] & 0xf) * 4;
+    bool fragment = (packet[6] & 0x3f) || packet[7];    // MF 或片偏移不为 0
+    uint32_t ports = 0;
+    if ((proto == 6 || proto == 17) && !fragment && len >= ihl + 4) ports = *(const uint32_t *)(packet + ihl);
+    return mix(mix(mix(src) ^ dst) ^ ports ^ uint32_t(proto) << 24);
+}
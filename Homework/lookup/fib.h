@@ -0,0 +1,44 @@
+#ifndef __FIB_H__
+#define __FIB_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+
+// 使用前先 include "router.h"
+
+/*
+  转发表（FIB）引擎的公共接口。
+  lookup.cpp 中的路由表（RIB）保存完整的表项，修改时同步到当前选用的引擎，
+  转发查询只走引擎。不同引擎在表的规模、修改频率、查询速度和内存之间取舍不同，
+  可以在启动时按名字选择，也可以在同一个程序中比较。
+  地址和下一跳都是大端序，和 RoutingTableEntry 一致。
+*/
+struct FibEngine {
+    virtual ~FibEngine() {}
+    virtual const char *name() const = 0;
+    // 已有 addr 和 len 都相同的前缀时替换
+    virtual void insert(const RoutingTableEntry &entry) = 0;
+    // 按 addr 和 len 匹配，不存在时什么也不做
+    virtual void remove(const RoutingTableEntry &entry) = 0;
+    virtual void clear() = 0;
+    // 用 n 条前缀重建整个表，默认清空后逐条插入，能整体构建的引擎可以更快；之后同样要 commit
+    virtual void build(const RoutingTableEntry *entries, size_t n) {
+        clear();
+        for (size_t i = 0; i < n; i++) insert(entries[i]);
+    }
+    // 一次或一批修改结束时调用。需要整理辅助结构的引擎在这里整理，查询路径上不做这些工作，
+    // 修改之后、commit 之前的查询可能看到修改前的表
+    virtual void commit() {}
+    virtual bool lookup(uint32_t addr, uint32_t *nexthop, uint32_t *if_index) = 0;
+    // 一次查多个地址，dir24 用 AVX2 实现。目前只有 bench 通过 query_batch 调用：
+    // HAL 每次只收一个包，路由器转发时逐包走 query_flow （要按五元组选等价路径）和目的地址缓存
+    virtual void lookup_batch(const uint32_t *addr, int n, uint32_t *nexthop, uint32_t *if_index, bool *found) {
+        for (int i = 0; i < n; i++) found[i] = lookup(addr[i], &nexthop[i], &if_index[i]);
+    }
+    // 按任意顺序访问每条前缀，只有 addr、len、if_index 和 nexthop 有意义
+    virtual void iterate(const std::function<void(const RoutingTableEntry &)> &visit) const = 0;
+    virtual size_t memory_usage() const = 0;
+};
+
+#endif
@@ -0,0 +1,69 @@
+#include <stdint.h>
+#include <map>
+#include <utility>
+#include <sys/mman.h>
+
+#include "hugepage.h"
+
+static bool enabled = true;
+
+enum page_kind { HUGETLB, THP, SMALL };
+// 起始地址 -> (大小, 页的种类)，释放时用。
+// 第一次使用时创建且从不析构：其他文件中的静态对象（如 lookup.cpp 的路由表）在退出时析构，
+// 那时还要用它来释放内存，不能依赖静态对象的析构顺序
+static std::map<void *, std::pair<size_t, page_kind>> &blocks() {
+    static auto map = new std::map<void *, std::pair<size_t, page_kind>>;
+    return *map;
+}
+static size_t bytes[3];
+
+void set_huge_pages(bool enable) {
+    enabled = enable;
+}
+
+static void *record(void *p, size_t size, page_kind kind) {
+    blocks()[p] = std::make_pair(size, kind);
+    bytes[kind] += size;
+    return p;
+}
+
+void *huge_alloc(size_t size) {
+    size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    void *p;
+#ifdef MAP_HUGETLB
+    if (enabled) {
+        p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) return record(p, size, HUGETLB);
+    }
+#endif
+    // 多映射一个大页，把起点对齐到 2MB ，透明大页才能整页使用
+    p = mmap(nullptr, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return nullptr;
+    uintptr_t begin = (uintptr_t)p, aligned = (begin + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    if (aligned > begin) munmap(p, aligned - begin);
+    if (aligned + size < begin + size + HUGE_PAGE_SIZE) {
+        munmap((void *)(aligned + size), begin + HUGE_PAGE_SIZE - aligned);
+    }
+    p = (void *)aligned;
+#ifdef MADV_HUGEPAGE
+    if (enabled && madvise(p, size, MADV_HUGEPAGE) == 0) return record(p, size, THP);
+#endif
+#ifdef MADV_NOHUGEPAGE
+    if (!enabled) madvise(p, size, MADV_NOHUGEPAGE);
+#endif
+    return record(p, size, SMALL);
+}
+
+void huge_free(void *p) {
+    auto it = blocks().find(p);
+    if (it == blocks().end()) return;
+    munmap(p, it->second.first);
+    bytes[it->second.second] -= it->second.first;
+    blocks().erase(it);
+}
+
+void huge_stats(size_t *hugetlb, size_t *thp, size_t *small) {
+    *hugetlb = bytes[HUGETLB];
+    *thp = bytes[THP];
+    *small = bytes[SMALL];
+}
@@ -0,0 +1,52 @@
+#ifndef __HUGEPAGE_H__
+#define __HUGEPAGE_H__
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <new>
+#include <vector>
+
+/*
+  大块的查找表放在 2MB 大页上，减少随机访问时的 TLB 缺失。
+  先试 MAP_HUGETLB（需要系统预留大页），失败时按 2MB 对齐后用 madvise 申请透明大页，
+  都不支持时就是普通的 4KB 页。关闭大页时同样用 mmap 分配并 MADV_NOHUGEPAGE，方便对比。
+*/
+static const size_t HUGE_PAGE_SIZE = 2 << 20;
+
+// 是否使用大页，默认使用，只影响之后的分配
+void set_huge_pages(bool enable);
+// 分配 size 字节清零的内存，按 2MB 向上取整，失败时返回 nullptr
+void *huge_alloc(size_t size);
+void huge_free(void *p);
+// 当前分配出去的字节数：MAP_HUGETLB 大页、透明大页、普通页
+void huge_stats(size_t *hugetlb, size_t *thp, size_t *small);
+
+// 不小于一个大页的分配走 huge_alloc ，其余的走 malloc
+template <typename T>
+struct HugeAllocator {
+    typedef T value_type;
+
+    HugeAllocator() {}
+    template <typename U> HugeAllocator(const HugeAllocator<U> &) {}
+
+    T *allocate(size_t n) {
+        void *p = n * sizeof(T) >= HUGE_PAGE_SIZE ? huge_alloc(n * sizeof(T)) : malloc(n * sizeof(T));
+        if (!p) throw std::bad_alloc();
+        return (T *)p;
+    }
+
+    void deallocate(T *p, size_t n) {
+        if (n * sizeof(T) >= HUGE_PAGE_SIZE) huge_free(p);
+        else free(p);
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const HugeAllocator<T> &, const HugeAllocator<U> &) { return true; }
+template <typename T, typename U>
+bool operator!=(const HugeAllocator<T> &, const HugeAllocator<U> &) { return false; }
+
+template <typename T>
+using huge_vector = std::vector<T, HugeAllocator<T>>;
+
+#endif
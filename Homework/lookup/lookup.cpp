@@ -3,127 +3,598 @@
 #include <iostream>
 #include <utility>
 #include <vector>
+#include <algorithm>
+#include <iterator>
+#include <string>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "router.h"
+#include "fib.h"
+#include "hugepage.h"
+
+// (前缀, 长度) -> 结点下标的开放寻址哈希表，线性探测，删除时后移以免留下墓碑
+struct PrefixIndex {
+    static constexpr uint64_t USED = 1ull << 63;
+    struct slot_t {
+        uint64_t key;       // 最高位为 1 表示被占用
+        uint32_t value;
+    };
+    std::vector<slot_t> slots;
+    size_t count = 0;
+
+    PrefixIndex() { clear(); }
+
+    void clear() {
+        std::vector<slot_t>(16, slot_t{0, 0}).swap(slots);
+        count = 0;
+    }
+
+    size_t home(uint64_t key) const {
+        return (key * 0x9e3779b97f4a7c15ull) >> 40 & (slots.size() - 1);
+    }
+
+    void reserve(size_t n) {
+        size_t size = slots.size();
+        while (size < n * 2) size *= 2;
+        if (size == slots.size()) return;
+        std::vector<slot_t> old(size, slot_t{0, 0});
+        old.swap(slots);
+        for (auto &s: old) {
+            if (!s.key) continue;
+            auto i = home(s.key);
+            while (slots[i].key) i = (i + 1) & (slots.size() - 1);
+            slots[i] = s;
+        }
+    }
+
+    // 没有找到时返回 0
+    uint32_t get(uint64_t key) const {
+        key |= USED;
+        for (auto i = home(key); slots[i].key; i = (i + 1) & (slots.size() - 1)) {
+            if (slots[i].key == key) return slots[i].value;
+        }
+        return 0;
+    }
+
+    // 不存在则插入值为 0 的一项
+    uint32_t &operator[](uint64_t key) {
+        if ((count + 1) * 2 > slots.size()) reserve(count + 1);
+        key |= USED;
+        auto i = home(key);
+        for (; slots[i].key; i = (i + 1) & (slots.size() - 1)) {
+            if (slots[i].key == key) return slots[i].value;
+        }
+        count++;
+        slots[i] = slot_t{key, 0};
+        return slots[i].value;
+    }
+
+    bool erase(uint64_t key) {
+        key |= USED;
+        auto mask = slots.size() - 1;
+        auto i = home(key);
+        for (; slots[i].key != key; i = (i + 1) & mask) {
+            if (!slots[i].key) return false;
+        }
+        // 把后面探测链上的项往前移，填上空位
+        for (auto j = (i + 1) & mask; slots[j].key; j = (j + 1) & mask) {
+            auto h = home(slots[j].key);
+            if (((j - h) & mask) >= ((j - i) & mask)) {
+                slots[i] = slots[j];
+                i = j;
+            }
+        }
+        slots[i] = slot_t{0, 0};
+        count--;
+        return true;
+    }
+};
 
 struct RouterTable {
+    // 结点和表项都存放在连续的数组中，用下标代替指针，下标 0 表示空
     struct node_t {
-        node_t *ch[2];
-        RoutingTableEntry *entry;
+        uint32_t ch[2];
+        uint32_t entry;     // 在 entries 中的下标
+    };
+    static constexpr uint32_t ROOT = 1;
+    huge_vector<node_t> nodes;                  // nodes[ROOT] 为根
+    huge_vector<RoutingTableEntry> entries;
+    std::vector<uint32_t> free_nodes, free_entries;
+    // (前缀, 长度) -> 存有该表项的结点，精确匹配时不用从根走下去
+    PrefixIndex index;
+    // 表项数组每 CHUNK 项（一个 RIP 包的容量）为一块，块中的表项有变化时换一个新的版本号，
+    // 用来缓存编码好的 RIP 包。版本号只增不减，clear 之后旧的版本号也不会再出现
+    static constexpr uint32_t CHUNK = 25;
+    std::vector<uint32_t> chunk_version;
+    uint32_t last_version = 0;
+
+    RouterTable() { clear(); }
+
+    // 同时释放占用的内存
+    void clear() {
+        huge_vector<node_t>(ROOT + 1, node_t{{0, 0}, 0}).swap(nodes);
+        huge_vector<RoutingTableEntry>(1, RoutingTableEntry()).swap(entries);
+        std::vector<uint32_t>().swap(free_nodes);
+        std::vector<uint32_t>().swap(free_entries);
+        std::vector<uint32_t>().swap(chunk_version);
+        index.clear();
+    }
 
-        node_t() { 
-            ch[0] = ch[1] = nullptr; 
-            entry = nullptr;
+    void touch(uint32_t e) {
+        size_t k = (e - 1) / CHUNK;
+        if (k >= chunk_version.size()) chunk_version.resize(k + 1, ++last_version);
+        chunk_version[k] = ++last_version;
+    }
+
+    void touch(const RoutingTableEntry *rte) {
+        touch(rte - entries.data());
+    }
+
+    // 下标 e 的表项是否在用（回收的表项不在索引中）
+    bool live(uint32_t e) const {
+        auto &rte = entries[e];
+        auto u = index.get(prefix_key(ntohl(rte.addr), rte.len));
+        return u && nodes[u].entry == e;
+    }
+
+    uint32_t new_node() {
+        if (!free_nodes.empty()) {
+            auto u = free_nodes.back();
+            free_nodes.pop_back();
+            return u;
         }
+        nodes.push_back(node_t{{0, 0}, 0});
+        return nodes.size() - 1;
+    }
 
-        void set(const RoutingTableEntry &entry) {
-            delete this->entry;
-            this->entry = new RoutingTableEntry(entry); 
+    uint32_t new_entry(const RoutingTableEntry &entry) {
+        if (!free_entries.empty()) {
+            auto e = free_entries.back();
+            free_entries.pop_back();
+            entries[e] = entry;
+            touch(e);
+            return e;
         }
-        bool has() const { return entry != nullptr; }
-        const RoutingTableEntry& get() const { return *entry; }
-        RoutingTableEntry& get() { return *entry; }
-        void remove() {
-            delete entry;
-            entry = nullptr;
+        entries.push_back(entry);
+        touch(entries.size() - 1);
+        return entries.size() - 1;
+    }
+
+    // 小端序的 addr 只保留前 len 位，和 len 一起作为 index 的键
+    static uint64_t prefix_key(uint32_t addr, uint32_t len) {
+        if (len < 32) addr &= ~(0xffffffffu >> len);
+        return uint64_t(addr) << 8 | len;
+    }
+
+    RoutingTableEntry *find(uint32_t addr, uint32_t len) {
+        auto u = index.get(prefix_key(addr, len));
+        return u ? &entries[nodes[u].entry] : nullptr;
+    }
+
+    // 从 u 开始沿 addr 走到深度 len ，缺少的结点新建
+    uint32_t descend(uint32_t u, int from, uint32_t addr, uint32_t len) {
+        for (int i = from; i < len; i++) {
+            int b = addr >> (31 - i) & 1;
+            auto v = nodes[u].ch[b];
+            if (!v) {
+                v = new_node();
+                nodes[u].ch[b] = v;
+            }
+            u = v;
         }
-    };
-    node_t *root = nullptr;
+        return u;
+    }
 
     void insert(const RoutingTableEntry &entry) {
         auto addr = ntohl(entry.addr);
-        if (!root) root = new node_t;
-        auto u = root;
-        for (int i = 0; i < entry.len; i++) {
-            auto &v = u->ch[addr >> (31 - i) & 1];
-            if (!v) v = new node_t;
-            u = v;
+        auto &slot = index[prefix_key(addr, entry.len)];
+        if (!slot) {
+            slot = descend(ROOT, 0, addr, entry.len);
+            nodes[slot].entry = new_entry(entry);
+        } else {
+            entries[nodes[slot].entry] = entry;
+            touch(nodes[slot].entry);
         }
-        u->set(entry);
     }
 
-    void remove(const RoutingTableEntry &entry) {
-        remove(root, 0, ntohl(entry.addr), entry.len);
+    // 插入或替换，返回表项是否有变化（新插入，或 nexthop、if_index、metric 不同）
+    bool upsert(const RoutingTableEntry &entry) {
+        auto old = find(ntohl(entry.addr), entry.len);
+        if (old) {
+            if (old->nexthop == entry.nexthop && old->if_index == entry.if_index && old->metric == entry.metric) return false;
+            *old = entry;
+            touch(old);
+            return true;
+        }
+        insert(entry);
+        return true;
     }
 
-    void recycle(node_t *&u) {
-        if (!u->ch[0] && !u->ch[1] && !u->has()) {
-            delete u;
-            u = nullptr;
-        }
+    void remove(const RoutingTableEntry &entry) {
+        auto addr = ntohl(entry.addr);
+        if (index.erase(prefix_key(addr, entry.len))) remove(ROOT, 0, addr, entry.len);
     }
 
-    void remove(node_t *&u, int i, uint32_t addr, uint32_t len) {
-        if (!u) return;
+    // 返回 u 是否已经没有用，可以回收
+    bool remove(uint32_t u, int i, uint32_t addr, uint32_t len) {
+        auto &node = nodes[u];
         if (i == len) {
-            u->remove();
+            touch(node.entry);
+            free_entries.push_back(node.entry);
+            node.entry = 0;
         } else {
-            remove(u->ch[addr >> (31 - i) & 1], i + 1, addr, len);
+            int b = addr >> (31 - i) & 1;
+            if (node.ch[b] && remove(node.ch[b], i + 1, addr, len)) {
+                free_nodes.push_back(node.ch[b]);
+                node.ch[b] = 0;
+            }
+        }
+        return u != ROOT && !node.ch[0] && !node.ch[1] && !node.entry;
+    }
+
+    struct sort_item_t {
+        uint64_t key;       // prefix_key
+        uint32_t i;         // 在输入数组中的下标
+    };
+
+    // 按 prefix_key 稳定排序，相同前缀保持输入中的先后。每趟按 8 位基数排序，
+    // 所有 key 这 8 位都相同的一趟跳过，输入已经有序时不排
+    static void sort_prefixes(std::vector<sort_item_t> &items) {
+        bool sorted = true;
+        for (size_t i = 1; i < items.size() && sorted; i++) sorted = items[i - 1].key <= items[i].key;
+        if (sorted) return;
+        std::vector<sort_item_t> tmp(items.size());
+        for (int shift = 0; shift < 40; shift += 8) {
+            size_t count[257] = {};
+            for (auto &item: items) count[(item.key >> shift & 0xff) + 1]++;
+            if (*std::max_element(count + 1, count + 257) == items.size()) continue;
+            for (int b = 1; b < 257; b++) count[b] += count[b - 1];
+            for (auto &item: items) tmp[count[item.key >> shift & 0xff]++] = item;
+            items.swap(tmp);
+        }
+    }
+
+    // 按先序排列的前缀与上一条共享的路径深度
+    static uint32_t shared_depth(uint32_t addr, uint32_t len, uint32_t last_addr, uint32_t last_len) {
+        uint32_t depth = std::min(len, last_len);
+        auto diff = addr ^ last_addr;
+        return diff ? std::min(depth, uint32_t(__builtin_clz(diff))) : depth;
+    }
+
+    /**
+     * 用一组无序的表项重建整个路由表，相同前缀保留最后一条。
+     * 按 (addr, len) 排好序即是 trie 的先序，每条前缀只需从与上一条分叉的深度往下新建结点：
+     * 第一遍据此算出结点总数，一次分配好结点数组；第二遍按先序依次编号、挂到路径上，
+     * 不再逐个结点分配和从根走下去。下标都是 32 位的，n 不能超过 2^32 - 2 。
+     */
+    void build(const RoutingTableEntry *a, size_t n) {
+        clear();
+        std::vector<sort_item_t> items(n);
+        for (size_t i = 0; i < n; i++) items[i] = sort_item_t{prefix_key(ntohl(a[i].addr), a[i].len), uint32_t(i)};
+        sort_prefixes(items);
+        entries.reserve(n + 1);
+        for (size_t i = 0; i < n; i++) {
+            if (i + 1 < n && items[i].key == items[i + 1].key) continue;
+            entries.push_back(a[items[i].i]);
+            entries.back().addr = htonl(uint32_t(items[i].key >> 8));
+        }
+        std::vector<sort_item_t>().swap(items);
+        uint32_t m = entries.size();
+        for (uint32_t e = 1; e < m; e += CHUNK) touch(e);
+
+        size_t total = nodes.size();
+        uint32_t last_addr = 0, last_len = 0;
+        for (uint32_t e = 1; e < m; e++) {
+            auto addr = ntohl(entries[e].addr);
+            auto len = entries[e].len;
+            total += len - shared_depth(addr, len, last_addr, last_len);
+            last_addr = addr;
+            last_len = len;
+        }
+        nodes.resize(total, node_t{{0, 0}, 0});
+        index.reserve(m);
+
+        uint32_t path[33] = {ROOT};     // 上一条前缀路径上各深度的结点
+        uint32_t next = ROOT + 1;
+        last_addr = last_len = 0;
+        for (uint32_t e = 1; e < m; e++) {
+            auto addr = ntohl(entries[e].addr);
+            auto len = entries[e].len;
+            auto depth = shared_depth(addr, len, last_addr, last_len);
+            auto u = path[depth];
+            for (uint32_t i = depth; i < len; i++) {
+                nodes[u].ch[addr >> (31 - i) & 1] = next;
+                u = path[i + 1] = next++;
+            }
+            nodes[u].entry = e;
+            index[prefix_key(addr, len)] = u;
+            last_addr = addr;
+            last_len = len;
         }
-        recycle(u);
     }
 
-    const node_t *query(uint32_t addr) const {
+    const RoutingTableEntry *query(uint32_t addr) const {
         addr = ntohl(addr);
-        if (!root) return nullptr;
-        auto u = root;
-        const node_t *ret = nullptr;
+        auto u = ROOT;
+        const RoutingTableEntry *ret = nodes[ROOT].entry ? &entries[nodes[ROOT].entry] : nullptr;
         for (int i = 31; i >= 0; i--) {
-            u = u->ch[addr >> i & 1];
+            u = nodes[u].ch[addr >> i & 1];
             if (!u) break;
-            if (u->has()) ret = u;
+            if (nodes[u].entry) ret = &entries[nodes[u].entry];
         }
         return ret;
     }
-    const node_t *query(uint32_t addr, uint32_t mask) const {
-        addr = ntohl(addr);
+    // 大端序的子网掩码对应的前缀长度
+    static uint32_t mask_len(uint32_t mask) {
         mask = ntohl(mask);
-        auto u = root;
-        for (int i = 31; u && (mask >> i & 1) && i >= 0; i--) {
-            u = u->ch[addr >> i & 1];
-        }
-        return u;
+        uint32_t len = 0;
+        while (len < 32 && (mask >> (31 - len) & 1)) len++;
+        return len;
     }
 
-    void dfs_all(node_t* x, std::vector<RoutingTableEntry>& result) {
+    const RoutingTableEntry *query(uint32_t addr, uint32_t mask) {
+        return find(ntohl(addr), mask_len(mask));
+    }
+
+    void dfs_all(uint32_t x, std::vector<RoutingTableEntry>& result) {
         if (!x) return;
-        if (x->has()) {
-            auto rte = x->get();
-            result.push_back(rte);
-            rte.flag = false;
-        }
-        dfs_all(x->ch[0], result);
-        dfs_all(x->ch[1], result);
+        if (nodes[x].entry) result.push_back(entries[nodes[x].entry]);
+        dfs_all(nodes[x].ch[0], result);
+        dfs_all(nodes[x].ch[1], result);
     }
     
     std::vector<RoutingTableEntry> get_all() {
         std::vector<RoutingTableEntry> ret;
-        dfs_all(root, ret);
+        dfs_all(ROOT, ret);
         return ret;
     }
     
-    void dfs_changed(node_t *&x, std::vector<RoutingTableEntry>& result) {
+    void dfs_changed(uint32_t x, std::vector<RoutingTableEntry>& result) {
         if (!x) return;
-        if (x->has()) {
-            auto &rte = x->get();
+        if (nodes[x].entry) {
+            auto &rte = entries[nodes[x].entry];
             if (rte.flag) {
                 result.push_back(rte);
                 rte.flag = false;
             }
         }
-        dfs_changed(x->ch[0], result);
-        dfs_changed(x->ch[1], result);
+        dfs_changed(nodes[x].ch[0], result);
+        dfs_changed(nodes[x].ch[1], result);
     }
 
     std::vector<RoutingTableEntry> get_changed() {
         std::vector<RoutingTableEntry> ret;
-        dfs_changed(root, ret);
+        dfs_changed(ROOT, ret);
         return ret;
     }
+
+    size_t memory_usage() const {
+        return nodes.capacity() * sizeof(node_t) + entries.capacity() * sizeof(RoutingTableEntry) +
+               (free_nodes.capacity() + free_entries.capacity()) * sizeof(uint32_t) +
+               index.slots.capacity() * sizeof(PrefixIndex::slot_t);
+    }
 };
+constexpr uint32_t RouterTable::ROOT;
 static RouterTable table;
 
+// 直接用一棵 trie 作为转发表，表项少、修改多时内存最省
+struct TrieEngine : FibEngine {
+    RouterTable trie;
+
+    const char *name() const override { return "trie"; }
+    void insert(const RoutingTableEntry &entry) override { trie.insert(entry); }
+    void remove(const RoutingTableEntry &entry) override { trie.remove(entry); }
+    void clear() override { trie.clear(); }
+    void build(const RoutingTableEntry *entries, size_t n) override { trie.build(entries, n); }
+
+    bool lookup(uint32_t addr, uint32_t *nexthop, uint32_t *if_index) override {
+        auto entry = trie.query(addr);
+        if (!entry) return false;
+        *nexthop = entry->nexthop;
+        *if_index = entry->if_index;
+        return true;
+    }
+
+    void iterate(const std::function<void(const RoutingTableEntry &)> &visit) const override {
+        // 回收的结点 entry 一定为 0
+        for (auto &node: trie.nodes) {
+            if (node.entry) visit(trie.entries[node.entry]);
+        }
+    }
+
+    size_t memory_usage() const override { return trie.memory_usage(); }
+};
+
+static FibEngine *new_trie_engine() {
+    return new TrieEngine;
+}
+// 见 dir24.cpp 和 bsl.cpp
+extern FibEngine *new_dir24_engine();
+extern FibEngine *new_bsl_engine();
+// 见 ortc.cpp ，接管 inner
+extern FibEngine *new_ortc_engine(FibEngine *inner);
+
+// 可选的转发表引擎，第一个为默认。
+// dir24 第一次插入时就要占用 64 MiB ，表项很少时不划算，只在用 -e 指定时使用
+static const struct {
+    const char *name;
+    FibEngine *(*create)();
+} engines[] = {
+    {"trie", new_trie_engine},
+    {"dir24", new_dir24_engine},    // DIR-24-8 平坦表，查询最快，固定占用 64 MiB
+    {"bsl", new_bsl_engine},        // 按前缀长度二分的哈希表
+};
+static FibEngine *fib = nullptr;
+
+// 当前的转发表引擎，第一次使用时创建默认引擎
+static FibEngine *engine() {
+    if (!fib) fib = engines[0].create();
+    return fib;
+}
+
+// 等价多路径的下一跳组，见 ecmp.cpp
+extern uint32_t ecmp_alloc();
+extern void ecmp_release(uint32_t group);
+extern void ecmp_clear();
+extern bool ecmp_add(uint32_t group, uint32_t nexthop, uint32_t if_index);
+extern bool ecmp_remove(uint32_t group, uint32_t nexthop, uint32_t if_index);
+extern uint32_t ecmp_size(uint32_t group);
+extern void ecmp_member(uint32_t group, uint32_t i, uint32_t *nexthop, uint32_t *if_index);
+extern void ecmp_select(uint32_t group, uint32_t hash, uint32_t *nexthop, uint32_t *if_index);
+extern size_t ecmp_memory_usage();
+extern uint32_t addr_hash(uint32_t addr);
+
+// 有不止一条等价路径的前缀 -> 下一跳组；RIB 中的表项只记其中一条（主路径）
+static PrefixIndex multipath;
+// 转发表中指向下一跳组的表项：if_index 为 ECMP_IF ，nexthop 为组号
+static constexpr uint32_t ECMP_IF = 0xfffffffeu;
+
+static uint64_t key_of(const RoutingTableEntry &entry) {
+    return RouterTable::prefix_key(ntohl(entry.addr), entry.len);
+}
+
+// RIB 表项在转发表中的样子
+static RoutingTableEntry fib_entry(const RoutingTableEntry &entry) {
+    auto group = multipath.get(key_of(entry));
+    if (!group) return entry;
+    RoutingTableEntry ret = entry;
+    ret.nexthop = group;
+    ret.if_index = ECMP_IF;
+    return ret;
+}
+
+// metric 为 16 的路由在垃圾回收前仍留在 RIB 中通告出去，但不放进转发表
+static bool reachable(const RoutingTableEntry &entry) {
+    return ntohl(entry.metric) < 16;
+}
+
+// 前缀回到只有一条路径
+static void drop_group(const RoutingTableEntry &entry) {
+    auto key = key_of(entry);
+    auto group = multipath.get(key);
+    if (!group) return;
+    ecmp_release(group);
+    multipath.erase(key);
+}
+
+// 引擎查到的是下一跳组时按 hash 从中选一条，返回是否是多路径
+static bool resolve(uint32_t hash, uint32_t *nexthop, uint32_t *if_index) {
+    if (*if_index != ECMP_IF) return false;
+    ecmp_select(*nexthop, hash, nexthop, if_index);
+    return true;
+}
+
+/*
+  FIB 快照文件格式（主机字节序）：
+    snapshot_header_t
+    node_t[node_count]            下标 0 不使用，下标 1 为根，和 RouterTable 的结点相同
+    snapshot_entry_t[entry_count] 下标 0 不使用
+  结点之间只用下标相连，文件可以原样 mmap 到任意地址，直接在上面查表。
+*/
+static const char SNAPSHOT_MAGIC[8] = "RLABFIB";
+static constexpr uint32_t SNAPSHOT_VERSION = 1;
+static constexpr uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
+
+struct snapshot_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;    // 用于识别其他字节序的机器写出的文件
+    uint32_t node_count;
+    uint32_t entry_count;
+    uint64_t node_offset;   // 相对文件开头
+    uint64_t entry_offset;
+};
+
+struct snapshot_entry_t {
+    uint32_t addr;
+    uint32_t len;
+    uint32_t if_index;
+    uint32_t nexthop;
+    uint32_t metric;
+};
+
+// mmap 进来的只读快照，转成路由表之前转发查询和读路由表都直接在上面进行
+struct FibImage {
+    void *base = nullptr;
+    size_t size = 0;
+    const RouterTable::node_t *nodes = nullptr;
+    const snapshot_entry_t *entries = nullptr;
+    uint32_t node_count = 0;
+    uint32_t entry_count = 0;
+    uint32_t version = 0;   // 各块共用的版本号，取自 RouterTable 的版本号序列
+
+    bool mapped() const { return base != nullptr; }
+
+    // 表项按先序排列，下标 e 从 1 开始
+    RoutingTableEntry entry(uint32_t e) const {
+        RoutingTableEntry rte = RoutingTableEntry();
+        rte.addr = entries[e].addr;
+        rte.len = entries[e].len;
+        rte.if_index = entries[e].if_index;
+        rte.nexthop = entries[e].nexthop;
+        rte.metric = entries[e].metric;
+        return rte;
+    }
+
+    // 精确匹配，addr 为小端序
+    const snapshot_entry_t *find(uint32_t addr, uint32_t len) const {
+        uint32_t u = RouterTable::ROOT;
+        for (uint32_t i = 0; i < len; i++) {
+            u = nodes[u].ch[addr >> (31 - i) & 1];
+            if (!u || u >= node_count) return nullptr;
+        }
+        auto e = nodes[u].entry;
+        return e && e < entry_count ? &entries[e] : nullptr;
+    }
+
+    // 文件内容不可信，载入时不逐项检查，查询时检查下标
+    const snapshot_entry_t *query(uint32_t addr) const {
+        addr = ntohl(addr);
+        uint32_t u = RouterTable::ROOT, ret = nodes[u].entry;
+        for (int i = 31; i >= 0; i--) {
+            u = nodes[u].ch[addr >> i & 1];
+            if (!u || u >= node_count) break;
+            if (nodes[u].entry) ret = nodes[u].entry;
+        }
+        return ret && ret < entry_count ? &entries[ret] : nullptr;
+    }
+
+    void unmap() {
+        if (base) munmap(base, size);
+        *this = FibImage();
+    }
+};
+static FibImage image;
+// 每次修改路由表都加一，转发路径上的缓存据此判断是否过期
+static uint32_t generation = 0;
+
+/*
+  批量修改：batch_begin 和 batch_commit 之间的修改不改变 generation ，
+  提交时有修改才加一，转发路径只会看到整批修改之前或之后的路由表。
+  期间表项有变化的前缀记在 batch_keys 中，提交时去重后给出。
+  转发表引擎的 commit 也在提交时才做（不在批中时每次修改做一次），见 fib.h 。
+*/
+static bool batching = false;
+static bool batch_dirty = false;
+static std::vector<uint64_t> batch_keys;
+
+// 修改完了转发表，changed 表示 RIB 中的表项本身也变了
+static void bump(const RoutingTableEntry &entry, bool changed) {
+    if (!batching) {
+        generation++;
+        engine()->commit();
+        return;
+    }
+    batch_dirty = true;
+    if (changed) batch_keys.push_back(RouterTable::prefix_key(ntohl(entry.addr), entry.len));
+}
+
 /*
   RoutingTable Entry 的定义如下：
   typedef struct {
@@ -140,42 +611,408 @@ static RouterTable table;
   你可以在全局变量中把路由表以一定的数据结构格式保存下来。
 */
 
+static void table_build(const RoutingTableEntry *entries, size_t n) {
+    table.build(entries, n);
+    multipath.clear();
+    ecmp_clear();
+    // RIB 的表项已经排好序、去掉了重复，引擎整体构建时不用再排；有不可达的表项时才要复制一份
+    const RoutingTableEntry *fib = table.entries.data() + 1;
+    size_t m = table.entries.size() - 1;
+    std::vector<RoutingTableEntry> reachable_entries;
+    if (!std::all_of(fib, fib + m, reachable)) {
+        std::copy_if(fib, fib + m, std::back_inserter(reachable_entries), reachable);
+        fib = reachable_entries.data();
+        m = reachable_entries.size();
+    }
+    engine()->build(fib, m);
+    engine()->commit();
+}
+
+// 把 mmap 的快照转成可修改的路由表，在第一次修改路由表时进行，只读的操作都直接读快照
+static void materialize() {
+    if (!image.mapped()) return;
+    std::vector<RoutingTableEntry> entries;
+    for (uint32_t u = 1; u < image.node_count; u++) {
+        auto e = image.nodes[u].entry;
+        if (!e || e >= image.entry_count) continue;
+        // 前缀从树上的位置得不到，直接用表项中记录的
+        entries.push_back(image.entry(e));
+    }
+    image.unmap();
+    table_build(entries.data(), entries.size());
+}
+
 void update(bool insert, RoutingTableEntry entry) {
+    materialize();
+    drop_group(entry);
     if (insert) {
         table.insert(entry);
+        // 和 upsert 一样，不可达的路由只留在 RIB 中
+        if (reachable(entry)) engine()->insert(entry);
+        else engine()->remove(entry);
     } else {
         table.remove(entry);
+        engine()->remove(entry);
     }
+    bump(entry, true);
 }
 
 bool query(uint32_t addr, uint32_t *nexthop, uint32_t *if_index) {
-    auto node = table.query(addr);
-    bool ret;
-    if (node) {
-        const auto &entry = node->get();
-        *nexthop = entry.nexthop;
-        *if_index = entry.if_index;
-        ret = true;
-    } else {
-        ret = false;
+    if (image.mapped()) {
+        auto entry = image.query(addr);
+        if (!entry) return false;
+        *nexthop = entry->nexthop;
+        *if_index = entry->if_index;
+        return true;
+    }
+    if (!engine()->lookup(addr, nexthop, if_index)) return false;
+    resolve(addr_hash(addr), nexthop, if_index);
+    return true;
+}
+
+bool query_flow(uint32_t addr, uint32_t hash, uint32_t *nexthop, uint32_t *if_index, bool *multipath) {
+    *multipath = false;
+    if (image.mapped()) return query(addr, nexthop, if_index);
+    if (!engine()->lookup(addr, nexthop, if_index)) return false;
+    *multipath = resolve(hash, nexthop, if_index);
+    return true;
+}
+
+void query_batch(const uint32_t *addr, int n, uint32_t *nexthop, uint32_t *if_index, bool *found) {
+    if (image.mapped()) {
+        // 快照还没有转成路由表时转发表引擎是空的
+        for (int i = 0; i < n; i++) found[i] = query(addr[i], &nexthop[i], &if_index[i]);
+        return;
+    }
+    engine()->lookup_batch(addr, n, nexthop, if_index, found);
+    for (int i = 0; i < n; i++) {
+        if (found[i]) resolve(addr_hash(addr[i]), &nexthop[i], &if_index[i]);
     }
-    return ret;
 }
 
 bool query(uint32_t addr, uint32_t mask, RoutingTableEntry& entry) {
+    if (image.mapped()) {
+        auto e = image.find(ntohl(addr), RouterTable::mask_len(mask));
+        if (!e) return false;
+        entry = image.entry(e - image.entries);
+        return true;
+    }
     auto u = table.query(addr, mask);
-    if (u && u->has()) {
-        entry = u->get();
+    if (u) {
+        entry = *u;
         return 1;
     } else {
         return 0;
     }
 }
 
+bool upsert(const RoutingTableEntry &entry) {
+    materialize();
+    if (!table.upsert(entry)) return false;
+    drop_group(entry);
+    if (reachable(entry)) engine()->insert(entry);
+    else engine()->remove(entry);
+    bump(entry, true);
+    return true;
+}
+
+bool add_path(const RoutingTableEntry &entry) {
+    materialize();
+    auto rte = table.find(ntohl(entry.addr), entry.len);
+    if (!rte || rte->metric != entry.metric) return false;
+    if (rte->nexthop == entry.nexthop && rte->if_index == entry.if_index) return false;
+    auto key = key_of(entry);
+    auto group = multipath.get(key);
+    if (!group) {
+        group = ecmp_alloc();
+        ecmp_add(group, rte->nexthop, rte->if_index);
+    }
+    if (!ecmp_add(group, entry.nexthop, entry.if_index)) {
+        if (ecmp_size(group) == 1) ecmp_release(group);
+        return false;
+    }
+    multipath[key] = group;
+    engine()->insert(fib_entry(*rte));
+    // 多了一条路径，通告的表项不变
+    bump(*rte, false);
+    return true;
+}
+
+bool remove_path(const RoutingTableEntry &entry) {
+    materialize();
+    auto key = key_of(entry);
+    auto group = multipath.get(key);
+    if (!group) return false;
+    auto rte = table.find(ntohl(entry.addr), entry.len);
+    if (!rte || !ecmp_remove(group, entry.nexthop, entry.if_index)) return false;
+    // 去掉的是主路径时换成组里剩下的一条
+    if (rte->nexthop == entry.nexthop && rte->if_index == entry.if_index) {
+        ecmp_member(group, 0, &rte->nexthop, &rte->if_index);
+        rte->flag = true;
+        table.touch(rte);
+    }
+    if (ecmp_size(group) == 1) drop_group(*rte);
+    engine()->insert(fib_entry(*rte));
+    bump(*rte, true);
+    return true;
+}
+
+void build(const RoutingTableEntry *entries, size_t n) {
+    image.unmap();
+    generation++;
+    table_build(entries, n);
+}
+
+size_t get_memory_usage() {
+    return table.memory_usage() + engine()->memory_usage() + ecmp_memory_usage() +
+           multipath.slots.capacity() * sizeof(PrefixIndex::slot_t);
+}
+
+bool select_engine(const char *name) {
+    // "ortc-" 开头表示在引擎外面加一层 ORTC 压缩
+    static const char ORTC[] = "ortc-";
+    bool compress = strncmp(name, ORTC, strlen(ORTC)) == 0;
+    for (auto &e: engines) {
+        if (strcmp(e.name, compress ? name + strlen(ORTC) : name) != 0) continue;
+        if (fib && strcmp(fib->name(), name) == 0) return true;
+        materialize();
+        // 先把 RIB 中的表项全部放进新引擎，再替换旧引擎
+        auto next = compress ? new_ortc_engine(e.create()) : e.create();
+        for (auto &node: table.nodes) {
+            if (node.entry && reachable(table.entries[node.entry])) next->insert(fib_entry(table.entries[node.entry]));
+        }
+        next->commit();
+        delete fib;
+        fib = next;
+        generation++;
+        return true;
+    }
+    return false;
+}
+
+const char *get_engine_name() {
+    return engine()->name();
+}
+
+const char *get_engine_name(size_t i) {
+    return i < sizeof(engines) / sizeof(*engines) ? engines[i].name : nullptr;
+}
+
+uint32_t get_generation() {
+    return generation;
+}
+
+// 快照要等到批中第一次修改时才转成路由表
+void batch_begin() {
+    batching = true;
+    batch_dirty = false;
+    batch_keys.clear();
+}
+
+size_t batch_commit(std::vector<RoutingTableEntry> &changed) {
+    batching = false;
+    if (batch_dirty) {
+        generation++;
+        engine()->commit();
+    }
+    std::sort(batch_keys.begin(), batch_keys.end());
+    batch_keys.erase(std::unique(batch_keys.begin(), batch_keys.end()), batch_keys.end());
+    for (auto key: batch_keys) {
+        uint32_t addr = key >> 8, len = key & 0xff;
+        auto rte = table.find(addr, len);
+        if (rte) {
+            changed.push_back(*rte);
+        } else {
+            // 已经删除的前缀按不可达给出
+            RoutingTableEntry entry = RoutingTableEntry();
+            entry.addr = htonl(addr);
+            entry.len = len;
+            entry.metric = htonl(16);
+            changed.push_back(entry);
+        }
+    }
+    return batch_keys.size();
+}
+
 std::vector<RoutingTableEntry> get_all_entries() {
+    if (image.mapped()) {
+        std::vector<RoutingTableEntry> ret;
+        for (uint32_t e = 1; e < image.entry_count; e++) ret.push_back(image.entry(e));
+        return ret;
+    }
     return table.get_all();
 }
 
+size_t next_entries(uint32_t *cursor, RoutingTableEntry *out, size_t n) {
+    // 游标是结点下标，按结点数组的顺序走，回收的结点上没有表项；
+    // 快照还没有转成路由表时是快照中表项的下标
+    if (*cursor < RouterTable::ROOT) *cursor = RouterTable::ROOT;
+    size_t k = 0;
+    if (image.mapped()) {
+        for (; k < n && *cursor < image.entry_count; ++*cursor) out[k++] = image.entry(*cursor);
+        return k;
+    }
+    for (; k < n && *cursor < table.nodes.size(); ++*cursor) {
+        auto e = table.nodes[*cursor].entry;
+        if (e) out[k++] = table.entries[e];
+    }
+    return k;
+}
+
+// 快照按表项的下标同样分块
+size_t get_chunk_count() {
+    if (image.mapped()) return (image.entry_count - 1 + RouterTable::CHUNK - 1) / RouterTable::CHUNK;
+    return table.chunk_version.size();
+}
+
+uint32_t get_chunk_version(size_t k) {
+    if (image.mapped()) return image.version;
+    return table.chunk_version[k];
+}
+
+size_t get_chunk_entries(size_t k, RoutingTableEntry *out) {
+    size_t n = 0;
+    uint32_t begin = k * RouterTable::CHUNK + 1;
+    if (image.mapped()) {
+        uint32_t end = std::min(begin + RouterTable::CHUNK, image.entry_count);
+        for (uint32_t e = begin; e < end; e++) out[n++] = image.entry(e);
+        return n;
+    }
+    uint32_t end = std::min(begin + RouterTable::CHUNK, uint32_t(table.entries.size()));
+    for (uint32_t e = begin; e < end; e++) {
+        if (table.live(e)) out[n++] = table.entries[e];
+    }
+    return n;
+}
+
+size_t get_entry_count() {
+    if (image.mapped()) return image.entry_count - 1;
+    return table.index.count;
+}
+
+// 快照中的表项都没有标记为有变化
 std::vector<RoutingTableEntry> get_changed_entries() {
+    if (image.mapped()) return std::vector<RoutingTableEntry>();
     return table.get_changed();
-}
\ No newline at end of file
+}
+
+bool is_snapshot_mapped() {
+    return image.mapped();
+}
+
+// 把 mmap 的快照原样写到 path ，先写临时文件再改名
+static bool save_image(const char *path) {
+    std::string tmp = std::string(path) + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "wb");
+    if (!fp) return false;
+    bool ok = fwrite(image.base, 1, image.size, fp) == image.size;
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool save_snapshot(const char *path) {
+    if (image.mapped()) return save_image(path);
+    // 按先序重新编号，去掉空闲的结点和表项
+    std::vector<uint32_t> order, remap(table.nodes.size()), stack(1, RouterTable::ROOT);
+    uint32_t entry_count = 1;
+    while (!stack.empty()) {
+        auto u = stack.back();
+        stack.pop_back();
+        remap[u] = order.size() + 1;
+        order.push_back(u);
+        if (table.nodes[u].entry) entry_count++;
+        for (int b = 1; b >= 0; b--) {
+            if (table.nodes[u].ch[b]) stack.push_back(table.nodes[u].ch[b]);
+        }
+    }
+
+    snapshot_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.byte_order = SNAPSHOT_BYTE_ORDER;
+    header.node_count = order.size() + 1;
+    header.entry_count = entry_count;
+    header.node_offset = sizeof(header);
+    header.entry_offset = header.node_offset + uint64_t(header.node_count) * sizeof(RouterTable::node_t);
+
+    std::string tmp = std::string(path) + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "wb");
+    if (!fp) return false;
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    RouterTable::node_t node = {{0, 0}, 0};
+    ok = ok && fwrite(&node, sizeof(node), 1, fp) == 1;
+    uint32_t e = 1;
+    for (auto u: order) {
+        auto &old = table.nodes[u];
+        node.ch[0] = remap[old.ch[0]];
+        node.ch[1] = remap[old.ch[1]];
+        node.entry = old.entry ? e++ : 0;
+        ok = ok && fwrite(&node, sizeof(node), 1, fp) == 1;
+    }
+    snapshot_entry_t entry = snapshot_entry_t();
+    ok = ok && fwrite(&entry, sizeof(entry), 1, fp) == 1;
+    for (auto u: order) {
+        if (!table.nodes[u].entry) continue;
+        auto &rte = table.entries[table.nodes[u].entry];
+        entry.addr = rte.addr;
+        entry.len = rte.len;
+        entry.if_index = rte.if_index;
+        entry.nexthop = rte.nexthop;
+        entry.metric = rte.metric;
+        ok = ok && fwrite(&entry, sizeof(entry), 1, fp) == 1;
+    }
+    ok = fclose(fp) == 0 && ok;
+    // 先写临时文件再改名，正在 mmap 旧快照的进程不受影响
+    if (!ok || rename(tmp.c_str(), path) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool load_snapshot(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    void *base = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(snapshot_header_t)) {
+        base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (base == MAP_FAILED) return false;
+
+    auto header = (const snapshot_header_t *)base;
+    uint64_t size = st.st_size;
+    bool ok = memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) == 0 &&
+              header->version == SNAPSHOT_VERSION && header->byte_order == SNAPSHOT_BYTE_ORDER &&
+              header->node_count > RouterTable::ROOT && header->entry_count > 0 &&
+              header->node_offset % alignof(RouterTable::node_t) == 0 &&
+              header->entry_offset % alignof(snapshot_entry_t) == 0 &&
+              header->node_offset + uint64_t(header->node_count) * sizeof(RouterTable::node_t) <= size &&
+              header->entry_offset + uint64_t(header->entry_count) * sizeof(snapshot_entry_t) <= size;
+    if (!ok) {
+        munmap(base, st.st_size);
+        return false;
+    }
+
+    image.unmap();
+    image.base = base;
+    image.size = st.st_size;
+    image.nodes = (const RouterTable::node_t *)((const uint8_t *)base + header->node_offset);
+    image.entries = (const snapshot_entry_t *)((const uint8_t *)base + header->entry_offset);
+    image.node_count = header->node_count;
+    image.entry_count = header->entry_count;
+    table.clear();
+    image.version = ++table.last_version;
+    multipath.clear();
+    ecmp_clear();
+    engine()->clear();
+    engine()->commit();
+    generation++;
+    return true;
+}
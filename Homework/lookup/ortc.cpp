@@ -0,0 +1,379 @@
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <unordered_map>
+#include <arpa/inet.h>
+
+#include "router.h"
+#include "fib.h"
+
+/*
+  ORTC（Draves et al., Constructing Optimal IP Routing Tables）压缩层，
+  包在另一个转发表引擎外面：自己保存原始前缀组成的 trie ，
+  只把与之转发等价、条数最少的一组前缀放进内层引擎。
+    第一、二遍自底向上：缺少的孩子补成继承下一跳的叶子，
+      每个结点的候选集合为两个孩子集合的交，交为空时取并；
+    第三遍自顶向下：继承来的下一跳在候选集合中就不用放前缀，否则从集合中选一个放一条。
+  没有路由也当作一种下一跳，需要在有路由的区间中挖洞时放一条 if_index 为 DROP 的前缀，
+  查询命中这种前缀视为没有路由。
+
+  增量修改：按 /8 分块，前缀修改只重算它覆盖的块；
+  块根以上的 8 层是 256 个块根集合组成的满二叉树，每次重算。
+  修改只记下哪些块要重算，在 commit 时统一进行，批量修改只算一次，查询路径上不重算。
+*/
+struct OrtcEngine : FibEngine {
+    static constexpr uint32_t DROP = 0xffffffffu;
+    static constexpr uint32_t ROOT = 1;
+    static constexpr int BLOCK_LEN = 8;
+    static constexpr int BLOCKS = 1 << BLOCK_LEN;
+    static constexpr int TOP = BLOCKS;      // installed 中块根以上的前缀
+
+    struct node_t {
+        uint32_t ch[2];
+        uint32_t hop;       // 这个结点上的前缀的下一跳编号，0 表示没有前缀
+    };
+    // 放进内层引擎的一条前缀，key 为 (addr << 8 | len) ，先序生成，天然有序
+    struct route_t {
+        uint64_t key;
+        uint32_t hop;
+    };
+    typedef std::vector<uint32_t> hopset_t;     // 有序的下一跳编号集合，0 表示没有路由
+
+    FibEngine *inner;
+    std::string label;
+    std::vector<node_t> nodes;
+    std::vector<uint32_t> free_nodes;
+    size_t prefix_count = 0;
+    // 下一跳 (nexthop, if_index) 的编号，从 1 开始。
+    // 引用计数包括 trie 中的前缀和 installed 中的前缀，归零后编号回收；
+    // installed 也算在内，是因为 apply 要拿旧的编号和新的比较，不能在这之前被别的下一跳占用
+    std::vector<uint32_t> hop_addr, hop_if, hop_refs;
+    std::vector<uint32_t> free_hops;
+    std::unordered_map<uint64_t, uint32_t> hop_id;
+
+    std::vector<route_t> installed[BLOCKS + 1];
+    hopset_t root_set[BLOCKS];
+    uint32_t parent_choice[BLOCKS];             // 块根从上面继承的下一跳
+    std::vector<bool> dirty;
+    bool any_dirty = false;
+    std::vector<hopset_t> sets;                 // 第二遍的结果，按结点下标
+
+    OrtcEngine(FibEngine *inner) : inner(inner), label(std::string("ortc-") + inner->name()) { clear(); }
+    ~OrtcEngine() { delete inner; }
+
+    const char *name() const override { return label.c_str(); }
+
+    static uint64_t key_of(uint32_t addr, uint32_t len) { return uint64_t(addr) << 8 | len; }
+    static uint32_t mask(uint32_t len) { return len ? ~0u << (32 - len) : 0; }
+
+    void clear() override {
+        std::vector<node_t>(ROOT + 1, node_t{{0, 0}, 0}).swap(nodes);
+        std::vector<uint32_t>().swap(free_nodes);
+        prefix_count = 0;
+        hop_addr.assign(1, 0);
+        hop_if.assign(1, 0);
+        hop_refs.assign(1, 0);
+        std::vector<uint32_t>().swap(free_hops);
+        hop_id.clear();
+        for (auto &r: installed) std::vector<route_t>().swap(r);
+        for (int b = 0; b < BLOCKS; b++) {
+            root_set[b].assign(1, 0);
+            parent_choice[b] = 0;
+        }
+        dirty.assign(BLOCKS, false);
+        any_dirty = false;
+        inner->clear();
+    }
+
+    // 取得下一跳的编号并加一个引用
+    uint32_t intern(uint32_t nexthop, uint32_t if_index) {
+        auto &id = hop_id[uint64_t(nexthop) << 32 | if_index];
+        if (!id) {
+            if (!free_hops.empty()) {
+                id = free_hops.back();
+                free_hops.pop_back();
+                hop_addr[id] = nexthop;
+                hop_if[id] = if_index;
+            } else {
+                id = hop_addr.size();
+                hop_addr.push_back(nexthop);
+                hop_if.push_back(if_index);
+                hop_refs.push_back(0);
+            }
+        }
+        hop_refs[id]++;
+        return id;
+    }
+
+    // 编号 0 表示没有路由，不计引用
+    void hold(uint32_t id) {
+        if (id) hop_refs[id]++;
+    }
+
+    void release(uint32_t id) {
+        if (!id || --hop_refs[id]) return;
+        hop_id.erase(uint64_t(hop_addr[id]) << 32 | hop_if[id]);
+        free_hops.push_back(id);
+    }
+
+    void mark(uint32_t addr, uint32_t len) {
+        uint32_t first = addr >> (32 - BLOCK_LEN);
+        uint32_t count = len >= BLOCK_LEN ? 1 : 1u << (BLOCK_LEN - len);
+        for (uint32_t b = first; b < first + count; b++) dirty[b] = true;
+        any_dirty = true;
+    }
+
+    void insert(const RoutingTableEntry &entry) override {
+        auto addr = ntohl(entry.addr) & mask(entry.len);
+        uint32_t u = ROOT;
+        for (uint32_t i = 0; i < entry.len; i++) {
+            int b = addr >> (31 - i) & 1;
+            if (!nodes[u].ch[b]) {
+                uint32_t v;
+                if (!free_nodes.empty()) {
+                    v = free_nodes.back();
+                    free_nodes.pop_back();
+                } else {
+                    v = nodes.size();
+                    nodes.push_back(node_t());
+                }
+                nodes[v] = node_t{{0, 0}, 0};
+                nodes[u].ch[b] = v;
+            }
+            u = nodes[u].ch[b];
+        }
+        if (!nodes[u].hop) prefix_count++;
+        auto old = nodes[u].hop;
+        nodes[u].hop = intern(entry.nexthop, entry.if_index);
+        release(old);
+        mark(addr, entry.len);
+    }
+
+    void remove(const RoutingTableEntry &entry) override {
+        auto addr = ntohl(entry.addr) & mask(entry.len);
+        uint32_t path[33] = {ROOT};
+        uint32_t u = ROOT;
+        for (uint32_t i = 0; i < entry.len; i++) {
+            u = nodes[u].ch[addr >> (31 - i) & 1];
+            if (!u) return;
+            path[i + 1] = u;
+        }
+        if (!nodes[u].hop) return;
+        release(nodes[u].hop);
+        nodes[u].hop = 0;
+        prefix_count--;
+        // 回收不再有用的结点
+        for (int i = entry.len; i > 0; i--) {
+            auto &node = nodes[path[i]];
+            if (node.ch[0] || node.ch[1] || node.hop) break;
+            nodes[path[i - 1]].ch[addr >> (32 - i) & 1] = 0;
+            free_nodes.push_back(path[i]);
+        }
+        mark(addr, entry.len);
+    }
+
+    static void merge(const hopset_t &a, const hopset_t &b, hopset_t &out) {
+        out.clear();
+        std::set_intersection(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(out));
+        if (out.empty()) std::set_union(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(out));
+    }
+
+    // 第一、二遍，inherited 为从上面继承的下一跳
+    void pass2(uint32_t u, uint32_t inherited) {
+        auto &node = nodes[u];
+        uint32_t h = node.hop ? node.hop : inherited;
+        if (!node.ch[0] && !node.ch[1]) {
+            sets[u].assign(1, h);
+            return;
+        }
+        hopset_t leaf(1, h);
+        for (int b = 0; b < 2; b++) {
+            if (node.ch[b]) pass2(node.ch[b], h);
+        }
+        merge(node.ch[0] ? sets[node.ch[0]] : leaf, node.ch[1] ? sets[node.ch[1]] : leaf, sets[u]);
+    }
+
+    // 在集合中选一个，尽量不选“没有路由”，少放 DROP 前缀
+    static uint32_t pick(const hopset_t &set, uint32_t inherited) {
+        return std::binary_search(set.begin(), set.end(), inherited) ? inherited : set.back();
+    }
+
+    // 第三遍，结果按先序追加到 out
+    void pass3(uint32_t u, uint32_t addr, uint32_t depth, uint32_t inherited, uint32_t own_inherited,
+               std::vector<route_t> &out) {
+        auto &node = nodes[u];
+        uint32_t choice = pick(sets[u], inherited);
+        if (choice != inherited) out.push_back(route_t{key_of(addr, depth), choice});
+        if (!node.ch[0] && !node.ch[1]) return;
+        uint32_t h = node.hop ? node.hop : own_inherited;
+        for (uint32_t b = 0; b < 2; b++) {
+            uint32_t child = addr | b << (31 - depth);
+            if (node.ch[b]) {
+                pass3(node.ch[b], child, depth + 1, choice, h, out);
+            } else if (h != choice) {
+                out.push_back(route_t{key_of(child, depth + 1), h});
+            }
+        }
+    }
+
+    // 块根结点（不存在时为 0）和块根处继承的下一跳
+    uint32_t block_root(uint32_t b, uint32_t *inherited) {
+        uint32_t u = ROOT;
+        *inherited = 0;
+        for (int i = 0; i < BLOCK_LEN && u; i++) {
+            if (nodes[u].hop) *inherited = nodes[u].hop;
+            u = nodes[u].ch[b >> (BLOCK_LEN - 1 - i) & 1];
+        }
+        return u;
+    }
+
+    void block_pass2(uint32_t b) {
+        uint32_t inherited;
+        auto u = block_root(b, &inherited);
+        if (u) {
+            pass2(u, inherited);
+            root_set[b] = sets[u];
+        } else {
+            root_set[b].assign(1, inherited);
+        }
+    }
+
+    void block_pass3(uint32_t b, std::vector<route_t> &out) {
+        uint32_t inherited;
+        auto u = block_root(b, &inherited);
+        uint32_t addr = b << (32 - BLOCK_LEN);
+        if (u) {
+            pass3(u, addr, BLOCK_LEN, parent_choice[b], inherited, out);
+        } else if (inherited != parent_choice[b]) {
+            out.push_back(route_t{key_of(addr, BLOCK_LEN), inherited});
+        }
+    }
+
+    // 块根以上的满二叉树，下标 1 为根，BLOCKS + b 为第 b 块的块根
+    void top_pass3(std::vector<hopset_t> &heap, uint32_t i, uint32_t depth, uint32_t inherited,
+                   std::vector<route_t> &out) {
+        if (i >= BLOCKS) {
+            parent_choice[i - BLOCKS] = inherited;
+            return;
+        }
+        uint32_t choice = pick(heap[i], inherited);
+        uint32_t addr = depth ? (i - (1u << depth)) << (32 - depth) : 0;
+        if (choice != inherited) out.push_back(route_t{key_of(addr, depth), choice});
+        top_pass3(heap, i * 2, depth + 1, choice, out);
+        top_pass3(heap, i * 2 + 1, depth + 1, choice, out);
+    }
+
+    // 把 installed[slot] 换成 next ，差异交给内层引擎
+    void apply(int slot, std::vector<route_t> &next) {
+        auto &prev = installed[slot];
+        size_t i = 0, j = 0;
+        RoutingTableEntry entry = RoutingTableEntry();
+        auto set_entry = [&] (const route_t &r) {
+            entry.addr = htonl(uint32_t(r.key >> 8));
+            entry.len = r.key & 0xff;
+            entry.nexthop = r.hop ? hop_addr[r.hop] : 0;
+            entry.if_index = r.hop ? hop_if[r.hop] : DROP;
+        };
+        while (i < prev.size() || j < next.size()) {
+            if (j == next.size() || (i < prev.size() && prev[i].key < next[j].key)) {
+                set_entry(prev[i++]);
+                inner->remove(entry);
+            } else if (i == prev.size() || next[j].key < prev[i].key) {
+                set_entry(next[j++]);
+                inner->insert(entry);
+            } else {
+                if (prev[i].hop != next[j].hop) {
+                    set_entry(next[j]);
+                    inner->insert(entry);
+                }
+                i++, j++;
+            }
+        }
+        // 先加新的引用再放掉旧的，两边都有的编号不会中途回收
+        for (auto &r: next) hold(r.hop);
+        for (auto &r: prev) release(r.hop);
+        prev.swap(next);
+    }
+
+    void flush() {
+        any_dirty = false;
+        sets.resize(nodes.size());
+        for (int b = 0; b < BLOCKS; b++) {
+            if (dirty[b]) block_pass2(b);
+        }
+        std::vector<hopset_t> heap(BLOCKS * 2);
+        for (int b = 0; b < BLOCKS; b++) heap[BLOCKS + b] = root_set[b];
+        for (int i = BLOCKS - 1; i >= 1; i--) merge(heap[i * 2], heap[i * 2 + 1], heap[i]);
+        uint32_t old_choice[BLOCKS];
+        std::copy(parent_choice, parent_choice + BLOCKS, old_choice);
+        std::vector<route_t> next;
+        top_pass3(heap, 1, 0, 0, next);
+        apply(TOP, next);
+        for (int b = 0; b < BLOCKS; b++) {
+            if (!dirty[b] && parent_choice[b] == old_choice[b]) continue;
+            // 只有继承的下一跳变了的块，第二遍的结果没有保存，重算一次
+            if (!dirty[b]) block_pass2(b);
+            dirty[b] = false;
+            next.clear();
+            block_pass3(b, next);
+            apply(b, next);
+        }
+    }
+
+    // 内层引擎在 apply 中收到的修改也要 commit
+    void commit() override {
+        if (any_dirty) flush();
+        inner->commit();
+    }
+
+    bool lookup(uint32_t addr, uint32_t *nexthop, uint32_t *if_index) override {
+        return inner->lookup(addr, nexthop, if_index) && *if_index != DROP;
+    }
+
+    void lookup_batch(const uint32_t *addr, int n, uint32_t *nexthop, uint32_t *if_index, bool *found) override {
+        inner->lookup_batch(addr, n, nexthop, if_index, found);
+        for (int i = 0; i < n; i++) found[i] = found[i] && if_index[i] != DROP;
+    }
+
+    // 访问的是压缩前的前缀
+    void iterate(const std::function<void(const RoutingTableEntry &)> &visit) const override {
+        std::vector<std::pair<uint32_t, uint32_t>> stack(1, std::make_pair(ROOT, 0u));
+        std::vector<uint32_t> addrs(1, 0);
+        while (!stack.empty()) {
+            auto u = stack.back().first;
+            auto depth = stack.back().second;
+            auto addr = addrs.back();
+            stack.pop_back();
+            addrs.pop_back();
+            if (nodes[u].hop) {
+                RoutingTableEntry entry = RoutingTableEntry();
+                entry.addr = htonl(addr);
+                entry.len = depth;
+                entry.nexthop = hop_addr[nodes[u].hop];
+                entry.if_index = hop_if[nodes[u].hop];
+                visit(entry);
+            }
+            for (uint32_t b = 0; b < 2; b++) {
+                if (!nodes[u].ch[b]) continue;
+                stack.push_back(std::make_pair(nodes[u].ch[b], depth + 1));
+                addrs.push_back(addr | b << (31 - depth));
+            }
+        }
+    }
+
+    size_t memory_usage() const override {
+        size_t size = nodes.capacity() * sizeof(node_t) + free_nodes.capacity() * sizeof(uint32_t) +
+                      hop_addr.capacity() * 3 * sizeof(uint32_t) + free_hops.capacity() * sizeof(uint32_t) +
+                      inner->memory_usage();
+        for (auto &r: installed) size += r.capacity() * sizeof(route_t);
+        return size;
+    }
+};
+constexpr uint32_t OrtcEngine::DROP;
+constexpr uint32_t OrtcEngine::ROOT;
+
+FibEngine *new_ortc_engine(FibEngine *inner) {
+    return new OrtcEngine(inner);
+}
@@ -2,12 +2,16 @@
 #include <iostream>
 #include <stdint.h>
 #include <cassert>
+#include <string.h>
 #include <arpa/inet.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RIP_HAVE_AVX2
+#endif
+
 static uint16_t rev16(const uint8_t *val) { return (uint16_t(val[0]) << 8) + val[1]; }
 static uint16_t get16(const uint8_t *val) { return ntohs(rev16(val)); }
-static uint32_t rev32(const uint8_t *val) { return (uint32_t(val[0]) << 24) + (uint32_t(val[1]) << 16) + (uint32_t(val[2]) << 8) + val[3]; }
-static uint32_t get32(const uint8_t *val) { return ntohl(rev32(val)); }
 static constexpr uint16_t RIP_PORT = 0x0802;    // 520
 
 /*
@@ -39,21 +43,86 @@ static constexpr uint16_t RIP_PORT = 0x0802;    // 520
 
 // using namespace std;
 
+// mask 必须高位全 1，低位全 0 ：取反后是 0..01..1 ，加 1 后和自己没有公共的位
 bool check_subnet(uint32_t mask) {
-    mask = ntohl(mask);
-    for (int i = 0; i < 32; i++) {
-        // mask 必须高位全 1，地位全 0
-        if (mask >> i & 1) {
-            for (int j = i + 1; j < 32; j++) {
-                if (!(mask >> j & 1)) return 0;
-            }
-            break;
+    uint32_t inv = ~ntohl(mask);
+    return (inv & (inv + 1)) == 0;
+}
+
+/*
+  一次检查一个报文的全部表项：Family 和 Command 对应且 Tag 为 0（两个字段合成一个字比较），
+  Mask 连续，Metric 在 [1,16] 中（减 1 后小于 16）。
+  每项的错误位或到一起，最后只判断一次，循环中没有分支。
+  head 是 Family 和 Tag 按内存顺序合成的字，返回 0 表示全部合法。
+*/
+static uint32_t check_entries_scalar(const uint8_t *entries, uint32_t n, uint32_t head) {
+    uint32_t bad = 0;
+    for (uint32_t i = 0; i < n; i++, entries += 20) {
+        uint32_t word[5];
+        memcpy(word, entries, sizeof(word));
+        uint32_t inv = ~ntohl(word[2]);
+        bad |= (word[0] ^ head) | (inv & (inv + 1)) | (ntohl(word[4]) - 1) >> 4;
+    }
+    return bad;
+}
+
+#ifdef RIP_HAVE_AVX2
+/*
+  8 项（160 字节）一组，直接按 5 个 256 位向量读入，不用逐字段 gather 。
+  每个字都算出三种检查的结果，再按这个字在表项中的位置（第 0 、2 、4 个字）取需要的一种。
+*/
+struct EntryLanes {
+    alignas(32) uint32_t head[40], mask[40], metric[40];
+
+    EntryLanes() {
+        for (int i = 0; i < 40; i++) {
+            head[i] = i % 5 == 0 ? ~0u : 0;
+            mask[i] = i % 5 == 2 ? ~0u : 0;
+            metric[i] = i % 5 == 4 ? ~0u : 0;
         }
     }
-    return 1;
+};
+static const EntryLanes lanes;
+
+__attribute__((target("avx2")))
+static uint32_t check_entries_avx2(const uint8_t *entries, uint32_t n, uint32_t head) {
+    const __m256i bswap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                           3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    const __m256i heads = _mm256_set1_epi32(head);
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i ones = _mm256_set1_epi32(-1);
+    __m256i bad = _mm256_setzero_si256();
+    uint32_t i = 0;
+    for (; i + 8 <= n; i += 8, entries += 160) {
+        for (int k = 0; k < 5; k++) {
+            auto word = _mm256_loadu_si256((const __m256i *)entries + k);
+            auto host = _mm256_shuffle_epi8(word, bswap);
+            auto inv = _mm256_xor_si256(host, ones);
+            auto head_bad = _mm256_xor_si256(word, heads);
+            auto mask_bad = _mm256_and_si256(inv, _mm256_add_epi32(inv, one));
+            auto metric_bad = _mm256_srli_epi32(_mm256_sub_epi32(host, one), 4);
+            bad = _mm256_or_si256(bad, _mm256_and_si256(head_bad, _mm256_load_si256((const __m256i *)lanes.head + k)));
+            bad = _mm256_or_si256(bad, _mm256_and_si256(mask_bad, _mm256_load_si256((const __m256i *)lanes.mask + k)));
+            bad = _mm256_or_si256(bad, _mm256_and_si256(metric_bad, _mm256_load_si256((const __m256i *)lanes.metric + k)));
+        }
+    }
+    uint32_t any = !_mm256_testz_si256(bad, bad);
+    // 剩下不足 8 项的是 SSE 代码，先清掉 ymm 的高半部分，避免 AVX 和 SSE 混用的开销
+    _mm256_zeroupper();
+    return any | check_entries_scalar(entries, n - i, head);
 }
+#endif
 
-bool disassemble(const uint8_t *packet, uint32_t len, RipPacket *output) {
+static uint32_t check_entries(const uint8_t *entries, uint32_t n, uint32_t head) {
+#ifdef RIP_HAVE_AVX2
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    if (has_avx2) return check_entries_avx2(entries, n, head);
+#endif
+    return check_entries_scalar(entries, n, head);
+}
+
+// 检查报文并让 view 指向其中的 RIP 表项，规则和 disassemble 相同
+bool parse_rip(const uint8_t *packet, uint32_t len, RipView *view) {
     uint16_t tot_len = rev16(packet + 2);
     int IHL = packet[0] & 0xf;
     if (tot_len > len) return 0;
@@ -66,39 +135,30 @@ bool disassemble(const uint8_t *packet, uint32_t len, RipPacket *output) {
     uint16_t rip_len = udp_len - 8;
     packet += 8;
     if (rip_len < 4) return 0;
-    output->command = packet[0];
-    if (output->command != 1 && output->command != 2) return 0;
+    view->command = packet[0];
+    if (view->command != 1 && view->command != 2) return 0;
     uint8_t version = packet[1];
     if (version != 2) return 0;
     if (*(uint16_t*)(packet + 2) != 0) return 0;
     rip_len -= 4;
     packet += 4;
     if (rip_len % 20 != 0) return 0;
-    output->numEntries = rip_len / 20;
-    if (output->numEntries > RIP_MAX_ENTRY) return 0;
+    view->numEntries = rip_len / 20;
+    if (view->numEntries > RIP_MAX_ENTRY) return 0;
+    view->entries = packet;
 
-    auto check = [] (rip_command_t cmd, uint16_t family) {
-        switch (cmd) {
-            case rip_command_t::REQUEST: return family == 0;
-            case rip_command_t::RESPONSE: return family == 2;
-        }
-    };
-    for (int i = 0; i < output->numEntries; i++, packet += 20) {
-        auto &entry = output->entries[i];
-        uint16_t family = rev16(packet);
-        if (!check(static_cast<rip_command_t>(output->command), family)) return 0;
-        uint16_t tag = rev16(packet + 2);
-        if (tag) return 0;
-        entry.addr = get32(packet + 4);
-        entry.mask = get32(packet + 8);
-        if (!check_subnet(entry.mask)) return 0;
-        entry.nexthop = get32(packet + 12);
-        auto metric = rev32(packet + 16);
-        if (metric < 1 || metric > 16) return 0;
-        entry.metric = rev32((uint8_t*)&metric);
-        assert(metric == rev32((uint8_t*)&entry.metric));
-        // entries[i] = entry;
-    }
+    // Response 的 Family 为 2 ，Request 为 0
+    uint32_t head = view->command == rip_command_t::RESPONSE ? htonl(2 << 16) : 0;
+    if (check_entries(packet, view->numEntries, head)) return 0;
+    return 1;
+}
+
+bool disassemble(const uint8_t *packet, uint32_t len, RipPacket *output) {
+    RipView view;
+    if (!parse_rip(packet, len, &view)) return 0;
+    output->command = view.command;
+    output->numEntries = view.numEntries;
+    for (int i = 0; i < view.numEntries; i++) output->entries[i] = view.entry(i);
     return 1;
 }
 
@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <string.h>
 #define RIP_MAX_ENTRY 25
 typedef struct {
   // all fields are big endian
@@ -19,6 +20,29 @@ typedef struct {
   RipEntry entries[RIP_MAX_ENTRY];
 } RipPacket;
 
+// 直接在收到的报文上按下标读取表项，不复制
+// 由 parse_rip 检查并填写，使用期间报文的缓冲区不能改变
+typedef struct RipView {
+  uint32_t numEntries;
+  uint8_t command;
+  const uint8_t *entries; // 第一个表项，每项 20 字节
+
+  // 以下字段都是大端序，和 RipEntry 一致
+  uint32_t field(uint32_t i, uint32_t offset) const {
+    uint32_t value;
+    memcpy(&value, entries + i * 20 + offset, sizeof(value));
+    return value;
+  }
+  uint32_t addr(uint32_t i) const { return field(i, 4); }
+  uint32_t mask(uint32_t i) const { return field(i, 8); }
+  uint32_t nexthop(uint32_t i) const { return field(i, 12); }
+  uint32_t metric(uint32_t i) const { return field(i, 16); }
+  RipEntry entry(uint32_t i) const {
+    RipEntry e = {addr(i), mask(i), nexthop(i), metric(i)};
+    return e;
+  }
+} RipView;
+
 enum rip_command_t {
     REQUEST = 1,
     RESPONSE = 2,